@@ -29,11 +29,13 @@
  *
  */
 
-#include <time.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
 #include "ubasic.h"
+#include "tokenizer.h"
 
 static const char program_let[] =
 "10 let a = 42\n\
@@ -48,6 +50,14 @@ static const char program_goto[] =
 60 let c = 108\n\
 70 stop\n";
 
+static const char program_index[] =
+"5 let a = 0\n\
+20 let a = a + 1 : if a < 3 then goto 10\n\
+30 gosub 30 + 10 : if a = 6 then 50\n\
+40 let a = a * 2 : return\n\
+50 stop\n\
+10 goto 20\n";
+
 static const char program_loop[] =
 "10 for i = 0 to 126\n\
 20 for j = 0 to 126\n\
@@ -69,6 +79,64 @@ static const char program_fibs[] =
 140 next i\n\
 160 stop\n";
 
+static const char program_crunch[] =
+"10 rem\n\
+20 let a1 = -5 : let b$ = \"rem: \"\n\
+30 rem print a1\n\
+40 if len(b$) = 5 then let c = a1 * -2\n\
+50 stop\n";
+
+static const char program_expr[] =
+"10 dim b(3) : dim s$(2)\n\
+20 let b(2) = 7 : let a$ = \"hello\" + \" world\" : let s$(1) = a$\n\
+30 let c = (3 + 4) * 2 - 10 / 3 mod 2 + b(2)\n\
+40 if left$(s$(1), 5) = \"hello\" and right$(a$, 5) = \"world\" then let d = 1\n\
+50 let e = len(mid$(a$, 3, 4)) + code(chr$(65)) + val(\"-12\") + abs(-3) + sgn(-9)\n\
+60 if \"abc\" < \"abd\" and \"b\" > \"abc\" and a$ <> \"x\" then let f = len(chr$(66))\n\
+70 let a$ = a$ : let s$(1) = s$(1) : if a$ <> s$(1) then let f = 0\n\
+80 stop\n";
+
+static const char program_arrays[] =
+"10 dim a(3, 4) : dim n$(2)\n\
+20 for i = 0 to 3 : for j = 0 to 4 : let a(i, j) = i * 10 + j : next j : next i\n\
+30 for i = 0 to 3 : for j = 0 to 4\n\
+40 if a(i, j) <> i * 10 + j then let s = s + 1\n\
+50 next j : next i\n\
+60 let n$(2) = \"top\" : let t = a(3, 4)\n\
+70 stop\n";
+
+static const char program_base[] =
+"10 option base 1\n\
+20 dim c(2, 3)\n\
+30 let c(2, 3) = 5 : let c(1, 1) = 1\n\
+40 let c(0, 1) = 9\n";
+
+static const char program_strings[] =
+"10 let b$ = \"0123456789012345678901234567890123456789012345678\"\n\
+20 let a$ = b$ + b$ + b$ + b$ + b$\n\
+30 let c = len(a$ + \"\") + len(b$ + b$ + b$ + b$ + b$)\n\
+40 stop\n";
+
+static const char program_heap[] =
+"10 let b$ = \"0123456789012345678901234567890123456789012345678\"\n\
+20 let b$ = b$ + b$ + b$\n\
+30 for i = 1 to 120\n\
+40 let a$ = left$(b$, i) : let c$ = a$ + a$ : let a$ = a$\n\
+50 next i\n\
+60 let c = len(a$) + len(c$)\n\
+70 stop\n";
+
+static const char program_print[] =
+"10 for i = 1 to 20\n\
+20 print \"line\"; i\n\
+30 next i\n\
+40 stop\n";
+
+static const char program_numbers[] =
+"10 print 0; 7; 10; 99; 100; 1234; 32767; -1; -100; 0 - 32767 - 1\n\
+20 let a = 10000 : print a + 1; \",\"; 0 - a\n\
+30 stop\n";
+
 static const char program_peek_poke[] =
 "10 let a= peek(100) + 20 + 3\n\
 20 let z = peek(123)\n\
@@ -86,31 +154,119 @@ void poke_function(value_t arg, value_t value) {
     assert(arg == value);
 }
 
+static const char program_error[] =
+"10 let a = 1\n\
+20 let b = a / 0\n\
+30 let a = 2\n\
+40 stop\n";
+
+static const char program_steps[] =
+"10 for i = 1 to 1000 : let a = a + 1 : next i\n\
+20 if a = 1000 then let b = 1 : let b = b + 1 : goto 40\n\
+30 let b = 0\n\
+40 stop\n";
+
+static const char program_skip[] =
+"10 rem if then : goto 99 \"quoted\n\
+20 data 1, \"a:b\", 3\n\
+30 let a = 1 : if a = 2 then let a = 5 : let a = 6\n\
+40 if a = 1 then if a = 2 then let a = 7 : let a = 8\n\
+50 let b = a : data 4\n\
+60 if b = 1 then let c = 1 : if b = 2 then let c = 2\n\
+70 if c = 1 then rem : let c = 3\n\
+80 if c = 2 then 10\n";
+
+static const char program_read[] =
+"10 data 5, \"ab\", -2\n\
+20 read a, b$, c\n\
+30 restore 45\n\
+40 read d, e$\n\
+45 rem\n\
+50 let x = 1 : data 6, \"cd\"\n\
+60 restore : read f\n\
+70 read b$, c, d, e$, a\n";
+
+static const char program_for[] =
+"10 for i = 10 to 1 step 0 - 3 : let a = a + i : next i\n\
+20 for j = 1 to 10 : let j = j + 1 : let b = b + 1 : next j\n";
+
+static const char program_mat[] =
+"10 option base 1\n\
+20 dim a(2, 3) : dim b(3, 2) : dim c(2, 2) : dim i(2, 2) : dim v(3)\n\
+30 mat read a, b\n\
+40 mat c = a * b : mat i = idn : mat c = c * i\n\
+50 mat i = (3) * i : mat i = c - i\n\
+60 mat v = con : mat v = v + v\n\
+70 mat c = a + b\n\
+80 data 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12\n";
+
+static const char program_image[] =
+"10 data 1, \"ab\" : rem x\n\
+20 read a, b$ : if a = 1 then 40\n\
+30 let c = 5\n\
+40 go sub 60 : let d$ = b$ + \"c\"\n\
+50 stop\n\
+60 for i = 1 to 2 : next i : return\n";
+
+static const char program_stacks[] =
+"10 gosub 100\n\
+20 for i = 1 to 100\n\
+30 for j = 1 to 10 : if j = 3 then goto 50\n\
+40 next j\n\
+50 next i\n\
+60 stop\n\
+100 let d = d + 1 : if d < 200 then gosub 100\n\
+110 for k = 1 to 2 : return\n";
+
+static struct ubasic_ctx *tctx;
+static ubasic_sink_t sink;
+static unsigned int sink_size;
+static int sink_flags;
+
 /*---------------------------------------------------------------------------*/
-void run(const char program[]) {
+void run(const char program[], int flags) {
   static int test_num = 0;
-  clock_t start_t, end_t;
-  double delta_t;
-
-  start_t = clock();
 
   test_num++;
   printf("Running test #%u... ", test_num);
   fflush(stdout);
 
 
-  ubasic_init(program);
+  ubasic_free(tctx);
+  tctx = ubasic_init_flags(program, flags);
+  assert(tctx != NULL);
+  if (sink)
+    ubasic_set_output(tctx, sink, sink_size, sink_flags);
 
   do {
-    ubasic_run();
-  } while(!ubasic_finished());
+    ubasic_run(tctx);
+  } while(!ubasic_finished(tctx));
+
+  printf("done.\n");
+}
 
-  end_t = clock();
-  delta_t = (double)(end_t - start_t) / CLOCKS_PER_SEC;
+/*---------------------------------------------------------------------------*/
+static char output[256];
+static unsigned int output_len;
+static unsigned int output_calls;
 
-  printf("done. Run time: %.3f s\n", delta_t);
+static void output_sink(struct ubasic_ctx *c, const char *p, unsigned int len)
+{
+  assert(output_len + len <= sizeof(output));
+  memcpy(output + output_len, p, len);
+  output_len += len;
+  output_calls++;
 }
 
+static void run_output(const char program[], int size, int flags)
+{
+  output_len = output_calls = 0;
+  sink = output_sink;
+  sink_size = size;
+  sink_flags = flags;
+  run(program, UBASIC_CRUNCH | UBASIC_COMPILE);
+  sink = NULL;
+}
 
 void clear_display(void)
 {
@@ -132,32 +288,383 @@ void end_input(void)
 
 
 /*---------------------------------------------------------------------------*/
-int
-main(void)
+static void run_tests(int flags)
 {
   struct typevalue v;
-  run(program_let);
-  ubasic_get_variable(0, &v, 0, NULL);
+  struct ubasic_string_stats st;
+  struct ubasic_line_profile *lp;
+  struct ubasic_stats counts;
+  unsigned int fors, gosubs;
+  struct typevalue subs[2];
+  run(program_let, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
   assert(v.d.i == 42 && v.type == TYPE_INTEGER);
 
-  run(program_goto);
-  ubasic_get_variable(2, &v, 0, NULL);
+  run(program_goto, flags);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
   assert(v.d.i == 108 && v.type == TYPE_INTEGER);
 
-  run(program_loop);
-  ubasic_get_variable(0, &v, 0, NULL);
+  run(program_index, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 6 && v.type == TYPE_INTEGER);
+
+  run(program_loop, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
   assert(v.d.i == ((value_t)(126 * 126 * 10)) && v.type == TYPE_INTEGER);
 
-  run(program_fibs);
-  ubasic_get_variable(1, &v, 0, NULL);
+  run(program_fibs, flags);
+  ubasic_get_variable(tctx, 1, &v, 0, NULL);
   assert(v.d.i == 89 && v.type == TYPE_INTEGER);
 
-  run(program_peek_poke);
-  ubasic_get_variable(0, &v, 0, NULL);
+  run(program_peek_poke, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
   assert(v.d.i == 123 && v.type == TYPE_INTEGER);
-  ubasic_get_variable(25, &v, 0, NULL);
+  ubasic_get_variable(tctx, 25, &v, 0, NULL);
   assert(v.d.i == 123 && v.type == TYPE_INTEGER);
 
+  /* Every cell of a 2D array is its own, tops included */
+  run(program_arrays, flags);
+  ubasic_get_variable(tctx, 18, &v, 0, NULL);
+  assert(v.d.i == 0);
+  ubasic_get_variable(tctx, 19, &v, 0, NULL);
+  assert(v.d.i == 34);
+  subs[0].type = subs[1].type = TYPE_INTEGER;
+  subs[0].d.i = 1;
+  subs[1].d.i = 2;
+  ubasic_get_variable(tctx, 0, &v, 2, subs);
+  assert(v.d.i == 12);
+  subs[0].d.i = 2;
+  ubasic_get_variable(tctx, STRINGFLAG | 13, &v, 1, subs);
+  assert(memcmp(v.d.p, "\003top", 4) == 0);
+
+  /* Sized from OPTION BASE */
+  run(program_base, flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Subscript") == 0);
+  assert(ubasic_line(tctx) == 40);
+  subs[0].d.i = 2;
+  subs[1].d.i = 3;
+  ubasic_get_variable(tctx, 2, &v, 2, subs);
+  assert(v.d.i == 5);
+
+  /* The largest subscript there is */
+  run("10 dim a(32767) : let a(5) = 3 : let a(32767) = 7\n", flags);
+  assert(ubasic_failed(tctx) == NULL);
+  subs[0].d.i = 32767;
+  ubasic_get_variable(tctx, 0, &v, 1, subs);
+  assert(v.d.i == 7);
+  subs[0].d.i = 5;
+  ubasic_get_variable(tctx, 0, &v, 1, subs);
+  assert(v.d.i == 3);
+
+  /* A bad line loads, and only fails if it is run */
+  run("10 let a = 1\n20 stop\n30 print \"bad\n", flags);
+  assert(ubasic_failed(tctx) == NULL);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 1);
+  run("10 let a = 1\n20 print \"bad\n30 let a = 2\n", flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Syntax") == 0);
+  assert(ubasic_line(tctx) == 20);
+
+  /* Names past the variable table are refused, compiled or not */
+  run("10 let z9 = 1\n", flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "badv") == 0);
+  run("10 let a = z9 + 1\n", flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "badv") == 0);
+
+  run(program_expr, flags);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 20 && v.type == TYPE_INTEGER);
+  ubasic_get_variable(tctx, 3, &v, 0, NULL);
+  assert(v.d.i == 1 && v.type == TYPE_INTEGER);
+  ubasic_get_variable(tctx, 4, &v, 0, NULL);
+  assert(v.d.i == 59 && v.type == TYPE_INTEGER);
+  ubasic_get_variable(tctx, 5, &v, 0, NULL);
+  assert(v.d.i == 1 && v.type == TYPE_INTEGER);
+
+  run(program_strings, flags);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 490 && v.type == TYPE_INTEGER);
+  assert(ubasic_string_highwater(tctx) > 512);
+
+  run(program_heap, flags);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 360 && v.type == TYPE_INTEGER);
+  ubasic_string_stats(tctx, &st);
+  assert(st.live == 147 + 120 + 240 + 3);
+  assert(st.used == 256 + 128 + 256);
+  assert(st.used + st.free <= st.heap);
+  assert(st.heap <= 4096);
+
+  run(program_crunch, flags);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 10 && v.type == TYPE_INTEGER);
+  assert(ubasic_failed(tctx) == NULL);
+
+  /* False IFs, REM and DATA skip the rest of the line */
+  run(program_skip, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 1);
+  ubasic_get_variable(tctx, 1, &v, 0, NULL);
+  assert(v.d.i == 1);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 1);
+
+  /* READ from the DATA table, until it runs out */
+  run(program_read, flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Out of DATA") == 0);
+  assert(ubasic_line(tctx) == 70);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 5);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == -2);
+  ubasic_get_variable(tctx, 3, &v, 0, NULL);
+  assert(v.d.i == 6);
+  ubasic_get_variable(tctx, 5, &v, 0, NULL);
+  assert(v.d.i == 5);
+  ubasic_get_variable(tctx, STRINGFLAG | 4, &v, 0, NULL);
+  assert(v.type == TYPE_STRING && memcmp(v.d.p, "\002cd", 3) == 0);
+
+  /* A bad DATA line loads, and READ reports it */
+  run("10 read a, a$\n20 stop\n30 data 4, \"abc\n", flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Syntax") == 0);
+  assert(ubasic_line(tctx) == 10);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 4);
+
+  /* Counting down, and a body that moves the loop variable */
+  run(program_for, flags);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 22);
+  ubasic_get_variable(tctx, 8, &v, 0, NULL);
+  assert(v.d.i == -2);
+  ubasic_get_variable(tctx, 1, &v, 0, NULL);
+  assert(v.d.i == 5);
+  ubasic_get_variable(tctx, 9, &v, 0, NULL);
+  assert(v.d.i == 11);
+
+  /* Whole arrays, and operands whose shapes don't fit */
+  run(program_mat, flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Dimension mismatch") == 0);
+  assert(ubasic_line(tctx) == 70);
+  subs[0].d.i = 2;
+  subs[1].d.i = 1;
+  ubasic_get_variable(tctx, 2, &v, 2, subs);
+  assert(v.d.i == 139);
+  ubasic_get_variable(tctx, 8, &v, 2, subs);
+  assert(v.d.i == 139);
+  subs[0].d.i = 1;
+  ubasic_get_variable(tctx, 8, &v, 2, subs);
+  assert(v.d.i == 55);
+  subs[0].d.i = 3;
+  ubasic_get_variable(tctx, 21, &v, 1, subs);
+  assert(v.d.i == 2);
+
+  /* Deep GOSUB, and loops left with GOTO or RETURN don't pile up */
+  run(program_stacks, flags);
+  assert(ubasic_failed(tctx) == NULL);
+  ubasic_stack_highwater(tctx, &fors, &gosubs);
+  assert(fors == 2 && gosubs == 200);
+  ubasic_get_variable(tctx, 9, &v, 0, NULL);
+  assert(v.d.i == 3);
+  ubasic_free(tctx);
+  tctx = ubasic_init_flags(program_stacks, flags | UBASIC_QUIET);
+  ubasic_set_stack_limits(tctx, UBASIC_FOR_DEPTH, 50);
+  ubasic_run_steps(tctx, 1000);
+  assert(strcmp(ubasic_failed(tctx), "GOSUB too deep") == 0);
+  /* A subroutine's loop on a variable doesn't take over the caller's */
+  run("10 for i = 1 to 3 : gosub 100 : next i\n20 stop\n"
+      "100 for i = 5 to 6 : let c = c + 1 : next i : return\n", flags);
+  assert(ubasic_failed(tctx) == NULL);
+  ubasic_get_variable(tctx, 2, &v, 0, NULL);
+  assert(v.d.i == 2);
+  run("10 return\n", flags | UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(tctx), "Return without gosub") == 0);
+
+  /* A budget of statements, however long the line */
+  ubasic_free(tctx);
+  tctx = ubasic_init_flags(program_steps, flags);
+  assert(ubasic_run_steps(tctx, 10) == 10);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 5);
+  assert(ubasic_run_steps(tctx, 2000 - 10) == 1990);
+  assert(!ubasic_finished(tctx));
+  assert(ubasic_run_steps(tctx, 100) == 6);
+  assert(ubasic_finished(tctx));
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 1000);
+  ubasic_get_variable(tctx, 1, &v, 0, NULL);
+  assert(v.d.i == 2);
+
+  /* Profiled, statements are charged to their lines */
+  run(program_steps, flags | UBASIC_PROFILE);
+  assert(ubasic_profile(tctx, &lp) == 3);
+  assert(lp[0].line == 10 && lp[0].runs == 1 && lp[0].statements == 2001);
+  assert(lp[1].line == 20 || lp[1].line == 40);
+  assert(lp[1].statements + lp[2].statements == 4 + 1);
+
+  /* Counters only when asked for */
+  assert(ubasic_stats(tctx, &counts) == 0);
+  run(program_steps, flags | UBASIC_STATS);
+  assert(ubasic_stats(tctx, &counts) == 1);
+  assert(counts.statements[TOKENIZER_FOR] == 1);
+  assert(counts.statements[TOKENIZER_NEXT] == 1000);
+  assert(counts.statements[TOKENIZER_LET] == 1002);
+  assert(counts.statements[TOKENIZER_IF] == 1);
+  assert(counts.tokens > 0);
+
+  /* Errors stop the program, not the process */
+  run(program_error, flags);
+  assert(strcmp(ubasic_failed(tctx), "Division by zero") == 0);
+  assert(ubasic_line(tctx) == 20);
+  ubasic_get_variable(tctx, 0, &v, 0, NULL);
+  assert(v.d.i == 1 && v.type == TYPE_INTEGER);
+}
+
+/*---------------------------------------------------------------------------*/
+static void null_sink(struct ubasic_ctx *c, const char *p, unsigned int len)
+{
+}
+
+/* Two programs stepped in turn must not see each other */
+static void run_interleaved(void)
+{
+  struct ubasic_ctx *a = ubasic_init(program_fibs);
+  struct ubasic_ctx *b = ubasic_init(program_loop);
+  struct typevalue v;
+
+  assert(a != NULL && b != NULL);
+  ubasic_set_output(b, null_sink, 0, 0);
+  while(!ubasic_finished(a) || !ubasic_finished(b)) {
+    ubasic_run(a);
+    ubasic_run(b);
+  }
+  ubasic_get_variable(a, 1, &v, 0, NULL);
+  assert(v.d.i == 89);
+  ubasic_get_variable(b, 0, &v, 0, NULL);
+  assert(v.d.i == (value_t)(126 * 126 * 10));
+  ubasic_free(a);
+  ubasic_free(b);
+}
+
+/*---------------------------------------------------------------------------*/
+/* A literal too long for its crunched length fails when it is run */
+static void run_long_string(void)
+{
+  struct ubasic_ctx *c;
+  char *program = malloc(70010);
+
+  assert(program != NULL);
+  memcpy(program, "10 print \"", 10);
+  memset(program + 10, 'x', 70000);
+  memcpy(program + 70000, "\"\n", 3);
+  c = ubasic_init_flags(program, UBASIC_CRUNCH | UBASIC_QUIET);
+  assert(c != NULL && ubasic_failed(c) == NULL);
+  do {
+    ubasic_run(c);
+  } while(!ubasic_finished(c));
+  assert(strcmp(ubasic_failed(c), "Syntax") == 0);
+  assert(ubasic_line(c) == 10);
+  ubasic_free(c);
+  free(program);
+}
+/*---------------------------------------------------------------------------*/
+static void run_image(void)
+{
+  struct ubasic_ctx *c;
+  struct typevalue v;
+  unsigned long len, i;
+  char *image;
+  char saved;
+  int n;
+
+  c = ubasic_init_flags(program_goto, UBASIC_COMPILE);
+  assert(ubasic_image(c, &len) == NULL);
+  ubasic_free(c);
+
+  c = ubasic_init(program_steps);
+  image = ubasic_image(c, &len);
+  assert(image != NULL);
+  ubasic_free(c);
+  c = ubasic_init_image(image, len, UBASIC_COMPILE);
+  assert(ubasic_failed(c) == NULL);
+  do {
+    ubasic_run(c);
+  } while(!ubasic_finished(c));
+  assert(ubasic_failed(c) == NULL);
+  ubasic_get_variable(c, 1, &v, 0, NULL);
+  assert(v.d.i == 2);
+  ubasic_free(c);
+
+  /* The DATA table goes with it */
+  c = ubasic_init(program_read);
+  free(image);
+  image = ubasic_image(c, &len);
+  ubasic_free(c);
+  c = ubasic_init_image(image, len, UBASIC_QUIET);
+  ubasic_run_steps(c, 100);
+  assert(strcmp(ubasic_failed(c), "Out of DATA") == 0);
+  ubasic_get_variable(c, 3, &v, 0, NULL);
+  assert(v.d.i == 6);
+  ubasic_free(c);
+
+  /* Cut short, or from another version */
+  c = ubasic_init_image(image, len - 1, UBASIC_QUIET);
+  assert(strcmp(ubasic_failed(c), "Bad image") == 0);
+  ubasic_free(c);
+  image[4]++;
+  c = ubasic_init_image(image, len, UBASIC_QUIET);
+  assert(ubasic_failed(c) != NULL && ubasic_finished(c));
+  ubasic_free(c);
+  free(image);
+
+  /* Damaged anywhere, it is refused or fails cleanly when run */
+  c = ubasic_init(program_image);
+  image = ubasic_image(c, &len);
+  assert(image != NULL);
+  ubasic_free(c);
+  for (i = 0; i < len; i++) {
+    for (n = 0; n < 2; n++) {
+      saved = image[i];
+      image[i] = n ? saved + 1 : ~saved;
+      c = ubasic_init_image(image, len, UBASIC_QUIET);
+      if (ubasic_failed(c) == NULL)
+        ubasic_run_steps(c, 50);
+      ubasic_free(c);
+      image[i] = saved;
+    }
+  }
+  free(image);
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(void)
+{
+  run_tests(UBASIC_CRUNCH | UBASIC_COMPILE);
+  run_tests(UBASIC_CRUNCH);
+  run_tests(UBASIC_COMPILE);
+  run_tests(0);
+  run_output(program_print, 64, 0);
+  assert(output_calls == 3);
+  run_output(program_print, 64, UBASIC_LINEBUF);
+  assert(output_calls == 20);
+  assert(output_len == 9 * 6 + 11 * 7);
+  assert(memcmp(output, "line1\nline2\n", 12) == 0);
+  assert(memcmp(output + output_len - 7, "line20\n", 7) == 0);
+
+  run_output(program_numbers, 0, 0);
+  assert(output_len == 44);
+  assert(memcmp(output,
+    "0710991001234"
+    "32767-1-100-32768\n10001,-10000\n", 44) == 0);
+  /* Too small a buffer for a whole number */
+  run_output(program_numbers, 3, 0);
+  assert(output_len == 44);
+
+  run_interleaved();
+  run_image();
+  run_long_string();
+  ubasic_free(tctx);
   return 0;
 }
 /*---------------------------------------------------------------------------*/
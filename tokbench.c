@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *	Tokenizer microbenchmark: lex the program text over and over the way
+ *	the interpreter does when it is not running a crunched program, then
+ *	look up every word in it both with the tokenizer and with the linear
+ *	scan of the keyword table it replaced, so the two can be compared.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "ubasic.h"
+#include "tokenizer.h"
+
+#define PASSES 20000
+#define MAX_WORDS 256
+
+static const char program[] =
+"10 let x = 0 : let y1 = 10\n\
+20 for i = 1 to 100 step 2\n\
+30 if x > y1 and i <> 5 then let x = x + i * 3 - y1 / 2\n\
+40 print \"x = \"; x, tab(20); y1\n\
+50 let a$ = left$(b$, 3) + chr$(65) : let z = len(a$) mod 7\n\
+60 rem a comment that is skipped\n\
+70 gosub 200 : poke peek(x), abs(y1)\n\
+80 next i\n\
+90 data 1, 2, 3, \"four\"\n\
+100 stop\n\
+200 let q = sgn(x) + int(y1) + val(\"42\") + code(\"A\")\n\
+210 return\n";
+
+/* The original lookup: every keyword in turn, in the original order */
+struct keyword_token {
+  char *keyword;
+  int token;
+};
+
+static const struct keyword_token linear_keywords[] = {
+  {"let", TOKENIZER_LET},
+  {"print", TOKENIZER_PRINT},
+  {"if", TOKENIZER_IF},
+  {"then", TOKENIZER_THEN},
+  {"else", TOKENIZER_ELSE},
+  {"for", TOKENIZER_FOR},
+  {"to", TOKENIZER_TO},
+  {"next", TOKENIZER_NEXT},
+  {"step", TOKENIZER_STEP},
+  {"go", TOKENIZER_GO},
+  {"sub", TOKENIZER_SUB},
+  {"return", TOKENIZER_RETURN},
+  {"call", TOKENIZER_CALL},
+  {"rem", TOKENIZER_REM},
+  {"poke", TOKENIZER_POKE},
+  {"peek", TOKENIZER_PEEK},
+  {"int", TOKENIZER_INT},
+  {"abs", TOKENIZER_ABS},
+  {"sgn", TOKENIZER_SGN},
+  {"len", TOKENIZER_LEN},
+  {"code", TOKENIZER_CODE},
+  {"val", TOKENIZER_VAL},
+  {"stop", TOKENIZER_STOP},
+  {"end", TOKENIZER_END},
+  {"and", TOKENIZER_AND},
+  {"or", TOKENIZER_OR},
+  {"dim", TOKENIZER_DIM},
+  {"data", TOKENIZER_DATA},
+  {"randomize", TOKENIZER_RANDOMIZE},
+  {"option", TOKENIZER_OPTION},
+  {"base", TOKENIZER_BASE},
+  {"input", TOKENIZER_INPUT},
+  {"restore", TOKENIZER_RESTORE},
+  {"tab", TOKENIZER_TAB},
+  {"left$", TOKENIZER_LEFTSTR},
+  {"right$", TOKENIZER_RIGHTSTR},
+  {"mid$", TOKENIZER_MIDSTR},
+  {"chr$", TOKENIZER_CHRSTR},
+  {"mod", TOKENIZER_MOD},
+  {"at", TOKENIZER_AT},
+  {"cls", TOKENIZER_CLS},
+  {"read", TOKENIZER_READ},
+  {"mat", TOKENIZER_MAT},
+  {"zer", TOKENIZER_ZER},
+  {"con", TOKENIZER_CON},
+  {"idn", TOKENIZER_IDN},
+  {NULL, TOKENIZER_ERROR}
+};
+
+static uint8_t linear_keyword(const char *text, char const **next)
+{
+  struct keyword_token const *kt;
+
+  for(kt = linear_keywords; kt->keyword != NULL; ++kt) {
+    if(strncasecmp(text, kt->keyword, strlen(kt->keyword)) == 0) {
+      *next = text + strlen(kt->keyword);
+      return kt->token;
+    }
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+value_t peek_function(value_t arg)
+{
+  return arg;
+}
+
+void poke_function(value_t arg, value_t value)
+{
+}
+
+void clear_display(void)
+{
+}
+
+int move_cursor(int x, int y)
+{
+  return 0;
+}
+
+void begin_input(void)
+{
+}
+
+void end_input(void)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+/* Seconds to look up every word PASSES times */
+static double time_lookup(uint8_t (*lookup)(const char *, char const **),
+                          const char **words, int nwords, unsigned long *sum)
+{
+  clock_t start_t;
+  char const *next;
+  int i, w;
+
+  start_t = clock();
+  for (i = 0; i < PASSES; i++)
+    for (w = 0; w < nwords; w++)
+      *sum += lookup(words[w], &next);
+  return (double)(clock() - start_t) / CLOCKS_PER_SEC;
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(void)
+{
+  clock_t start_t, end_t;
+  double delta_t, linear_t, indexed_t;
+  struct tokenizer_state ts;
+  unsigned long tokens = 0, linear_sum = 0, indexed_sum = 0;
+  const char *words[MAX_WORDS];
+  const char *p;
+  int i, nwords = 0;
+
+  tokenizer = &ts;
+  start_t = clock();
+  for (i = 0; i < PASSES; i++) {
+    tokenizer_init(program);
+    while(!tokenizer_finished()) {
+      if (current_token == TOKENIZER_REM)
+        tokenizer_newline();
+      else
+        tokenizer_next();
+      tokens++;
+    }
+  }
+  end_t = clock();
+  delta_t = (double)(end_t - start_t) / CLOCKS_PER_SEC;
+
+  printf("%lu tokens in %.3f s, %.0f tokens/s\n", tokens, delta_t,
+         delta_t ? tokens / delta_t : 0.0);
+
+  /* Every word, keyword or not, as the lexer would meet it */
+  for (p = program; *p && nwords < MAX_WORDS; p++)
+    if (isalpha((uint8_t)*p) && (p == program || !isalnum((uint8_t)p[-1])))
+      words[nwords++] = p;
+  linear_t = time_lookup(linear_keyword, words, nwords, &linear_sum);
+  indexed_t = time_lookup(tokenizer_keyword, words, nwords, &indexed_sum);
+  if (linear_sum != indexed_sum) {
+    printf("keyword lookups disagree\n");
+    return 1;
+  }
+  printf("%d words: linear %.0f lookups/s, indexed %.0f lookups/s, %.2fx\n",
+         nwords,
+         linear_t ? (double)nwords * PASSES / linear_t : 0.0,
+         indexed_t ? (double)nwords * PASSES / indexed_t : 0.0,
+         indexed_t ? linear_t / indexed_t : 0.0);
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
@@ -49,9 +49,7 @@
 #include "ubasic.h"
 #include "tokenizer.h"
 
-static char const *ptr, *nextptr;
-static char const *saved_ptr, *saved_next;
-static int saved_token;
+UBASIC_TLS struct tokenizer_state *tokenizer;
 
 
 #define MAX_NUMLEN 6
@@ -61,69 +59,110 @@ struct keyword_token {
   int token;
 };
 
-uint8_t current_token = TOKENIZER_ERROR;
-
+/* Sorted by first letter so that the lookup only has to try the keywords
+   that begin with the right letter. No keyword may be a prefix of another */
 static const struct keyword_token keywords[] = {
-  {"let", TOKENIZER_LET},
-  {"print", TOKENIZER_PRINT},
-  {"if", TOKENIZER_IF},
-  {"then", TOKENIZER_THEN},
+  {"abs", TOKENIZER_ABS},
+  {"and", TOKENIZER_AND},
+  {"at", TOKENIZER_AT},
+  {"base", TOKENIZER_BASE},
+  {"call", TOKENIZER_CALL},
+  {"chr$", TOKENIZER_CHRSTR},
+  {"cls", TOKENIZER_CLS},
+  {"code", TOKENIZER_CODE},
+  {"con", TOKENIZER_CON},
+  {"data", TOKENIZER_DATA},
+  {"dim", TOKENIZER_DIM},
   {"else", TOKENIZER_ELSE},
+  {"end", TOKENIZER_END},
   {"for", TOKENIZER_FOR},
-  {"to", TOKENIZER_TO},
-  {"next", TOKENIZER_NEXT},
-  {"step", TOKENIZER_STEP},
   {"go", TOKENIZER_GO},
-  {"sub", TOKENIZER_SUB},
-  {"return", TOKENIZER_RETURN},
-  {"call", TOKENIZER_CALL},
-  {"rem", TOKENIZER_REM},
-  {"poke", TOKENIZER_POKE},
-  {"peek", TOKENIZER_PEEK},
+  {"idn", TOKENIZER_IDN},
+  {"if", TOKENIZER_IF},
+  {"input", TOKENIZER_INPUT},
   {"int", TOKENIZER_INT},
-  {"abs", TOKENIZER_ABS},
-  {"sgn", TOKENIZER_SGN},
+  {"left$", TOKENIZER_LEFTSTR},
   {"len", TOKENIZER_LEN},
-  {"code", TOKENIZER_CODE},
-  {"val", TOKENIZER_VAL},
-  {"stop", TOKENIZER_STOP},
-  {"end", TOKENIZER_END},
-  {"and", TOKENIZER_AND},
-  {"or", TOKENIZER_OR},
-  {"dim", TOKENIZER_DIM},
+  {"let", TOKENIZER_LET},
+  {"mat", TOKENIZER_MAT},
+  {"mid$", TOKENIZER_MIDSTR},
+  {"mod", TOKENIZER_MOD},
+  {"next", TOKENIZER_NEXT},
 /* FIXME  {"not", TOKENIZER_NOT}, */
-  {"data", TOKENIZER_DATA},
-  {"randomize", TOKENIZER_RANDOMIZE},
   {"option", TOKENIZER_OPTION},
-  {"base", TOKENIZER_BASE},
-  {"input", TOKENIZER_INPUT},
+  {"or", TOKENIZER_OR},
+  {"peek", TOKENIZER_PEEK},
+  {"poke", TOKENIZER_POKE},
+  {"print", TOKENIZER_PRINT},
+  {"randomize", TOKENIZER_RANDOMIZE},
+  {"read", TOKENIZER_READ},
+  {"rem", TOKENIZER_REM},
   {"restore", TOKENIZER_RESTORE},
-  {"tab", TOKENIZER_TAB},
-  {"left$", TOKENIZER_LEFTSTR},
+  {"return", TOKENIZER_RETURN},
   {"right$", TOKENIZER_RIGHTSTR},
-  {"mid$", TOKENIZER_MIDSTR},
-  {"chr$", TOKENIZER_CHRSTR},
-  {"mod", TOKENIZER_MOD},
-  {"at", TOKENIZER_AT},
-  {"cls", TOKENIZER_CLS},
+  {"sgn", TOKENIZER_SGN},
+  {"step", TOKENIZER_STEP},
+  {"stop", TOKENIZER_STOP},
+  {"sub", TOKENIZER_SUB},
+  {"tab", TOKENIZER_TAB},
+  {"then", TOKENIZER_THEN},
+  {"to", TOKENIZER_TO},
+  {"val", TOKENIZER_VAL},
+  {"zer", TOKENIZER_ZER},
   {NULL, TOKENIZER_ERROR}
 };
 
+/* keywords[keyword_index[n]] is the first keyword starting with 'a' + n.
+   Constant so that any number of interpreters can share it; keep it in
+   step with keywords[] */
+static const uint8_t keyword_index[27] = {
+  0, 3, 4, 9, 11, 13, 14, 15, 15, 19, 19, 19, 22, 25, 26, 28, 31, 31, 37,
+  41, 44, 44, 45, 45, 45, 45, 46
+};
+
+/*---------------------------------------------------------------------------*/
+/* The keyword at text, setting *next past it, or 0 */
+uint8_t tokenizer_keyword(const char *text, char const **next)
+{
+  struct keyword_token const *kt, *end;
+  const char *k, *p;
+  uint8_t c = (*text | 0x20) - 'a';
+
+  if (c > 25)
+    return 0;
+  kt = keywords + keyword_index[c];
+  end = keywords + keyword_index[c + 1];
+  for(; kt < end; ++kt) {
+    /* We know the first letter matches */
+    k = kt->keyword + 1;
+    p = text + 1;
+    while(*k && tolower((uint8_t)*p) == *k) {
+      ++k;
+      ++p;
+    }
+    if (*k == 0) {
+      *next = p;
+      return kt->token;
+    }
+  }
+  return 0;
+}
+
 /*---------------------------------------------------------------------------*/
 static uint8_t doublechar(void)
 {
   /* Special case the paired single char symbols */
-  if (*ptr == '>' && ptr[1] == '=')
+  if (*tokenizer->ptr == '>' && tokenizer->ptr[1] == '=')
     return TOKENIZER_GE;
-  if (*ptr == '<' && ptr[1] == '=')
+  if (*tokenizer->ptr == '<' && tokenizer->ptr[1] == '=')
     return TOKENIZER_LE;
-  if (*ptr == '<' && ptr[1] == '>')
+  if (*tokenizer->ptr == '<' && tokenizer->ptr[1] == '>')
     return TOKENIZER_NE;
-  if (*ptr == '*' && ptr[1] == '*')
+  if (*tokenizer->ptr == '*' && tokenizer->ptr[1] == '*')
     return TOKENIZER_POWER;
-  if (*ptr == '\r' && ptr[1] == '\n')
+  if (*tokenizer->ptr == '\r' && tokenizer->ptr[1] == '\n')
     return TOKENIZER_NL;
-  if (*ptr == '\n' && ptr[1] == '\r')
+  if (*tokenizer->ptr == '\n' && tokenizer->ptr[1] == '\r')
     return TOKENIZER_NL;
   return 0;
 }
@@ -131,9 +170,9 @@ static uint8_t doublechar(void)
 /*---------------------------------------------------------------------------*/
 static uint8_t singlechar(void)
 {
-  if (strchr("\n,;+-&|*/(#)<>=^:?", *ptr))
-    return *ptr;
-  if (*ptr == '\r')
+  if (strchr("\n,;+-&|*/(#)<>=^:?", *tokenizer->ptr))
+    return *tokenizer->ptr;
+  if (*tokenizer->ptr == '\r')
     return TOKENIZER_NL;
   /* Not semantically meaningful */
   return 0;
@@ -141,31 +180,30 @@ static uint8_t singlechar(void)
 /*---------------------------------------------------------------------------*/
 static uint8_t get_next_token(void)
 {
-  struct keyword_token const *kt;
   int i;
   uint8_t t;
 
-  DEBUG_PRINTF("get_next_token(): '%s'\n", ptr);
+  DEBUG_PRINTF("get_next_token(): '%s'\n", tokenizer->ptr);
 
-  if(*ptr == 0) {
+  if(*tokenizer->ptr == 0) {
     return TOKENIZER_ENDOFINPUT;
   }
 
-  if ((isdigit(*ptr)) || (*ptr == '-' && isdigit(ptr[1]))) {
+  if ((isdigit(*tokenizer->ptr)) || (*tokenizer->ptr == '-' && isdigit(tokenizer->ptr[1]))) {
     i = 0;
-    if (*ptr == '-')
+    if (*tokenizer->ptr == '-')
       i = 1;
     for(; i < MAX_NUMLEN; ++i) {
-      if(!isdigit(ptr[i])) {
+      if(!isdigit(tokenizer->ptr[i])) {
         if(i > 0) {
-          nextptr = ptr + i;
+          tokenizer->nextptr = tokenizer->ptr + i;
           return TOKENIZER_NUMBER;
         } else {
           DEBUG_PRINTF("get_next_token: error due to too short number\n");
           return TOKENIZER_ERROR;
         }
       }
-      if(!isdigit(ptr[i])) {
+      if(!isdigit(tokenizer->ptr[i])) {
         DEBUG_PRINTF("get_next_token: error due to malformed number\n");
         return TOKENIZER_ERROR;
       }
@@ -173,37 +211,34 @@ static uint8_t get_next_token(void)
     DEBUG_PRINTF("get_next_token: error due to too long number\n");
     return TOKENIZER_ERROR;
   } else if((t = doublechar()) != 0) {
-    nextptr = ptr + 2;
+    tokenizer->nextptr = tokenizer->ptr + 2;
     return t;
   } else if((t = singlechar()) != 0) {
-    nextptr = ptr + 1;
+    tokenizer->nextptr = tokenizer->ptr + 1;
     return t;
-  } else if(*ptr == '"') {
-    nextptr = ptr;
+  } else if(*tokenizer->ptr == '"') {
+    tokenizer->nextptr = tokenizer->ptr;
     do {
-      ++nextptr;
-      if (!*nextptr || *nextptr == '\n' || *nextptr == '\r')
-        ubasic_tokenizer_error();
-    } while(*nextptr != '"');
-    ++nextptr;
+      ++tokenizer->nextptr;
+      /* Unterminated, so an error whenever the line runs. The next token
+         is the end of the line */
+      if (!*tokenizer->nextptr || *tokenizer->nextptr == '\n' || *tokenizer->nextptr == '\r')
+        return TOKENIZER_ERROR;
+    } while(*tokenizer->nextptr != '"');
+    ++tokenizer->nextptr;
     return TOKENIZER_STRING;
-  } else {
-    for(kt = keywords; kt->keyword != NULL; ++kt) {
-      if(strncasecmp(ptr, kt->keyword, strlen(kt->keyword)) == 0) {
-        nextptr = ptr + strlen(kt->keyword);
-        return kt->token;
-      }
-    }
+  } else if((t = tokenizer_keyword(tokenizer->ptr, &tokenizer->nextptr)) != 0) {
+    return t;
   }
 
-  if ((*ptr >= 'a' && *ptr <= 'z') || (*ptr >= 'A' && *ptr <= 'Z')) {
-    nextptr = ptr + 1;
-    if (*nextptr == '$') {
-      nextptr++;
+  if ((*tokenizer->ptr >= 'a' && *tokenizer->ptr <= 'z') || (*tokenizer->ptr >= 'A' && *tokenizer->ptr <= 'Z')) {
+    tokenizer->nextptr = tokenizer->ptr + 1;
+    if (*tokenizer->nextptr == '$') {
+      tokenizer->nextptr++;
       return TOKENIZER_STRINGVAR;
     }
-    if (isdigit(*nextptr))	/* A0-A9/B0-B9/etc */
-      nextptr++;
+    if (isdigit(*tokenizer->nextptr))	/* A0-A9/B0-B9/etc */
+      tokenizer->nextptr++;
     return TOKENIZER_INTVAR;
   }
 
@@ -211,30 +246,269 @@ static uint8_t get_next_token(void)
   return TOKENIZER_ERROR;
 }
 /*---------------------------------------------------------------------------*/
+static value_t raw_num(void)
+{
+  return atoi(tokenizer->ptr);
+}
+/*---------------------------------------------------------------------------*/
+static int raw_variable_num(void)
+{
+  if (tokenizer->ptr[1] == '$')
+    return STRINGFLAG | (toupper(*tokenizer->ptr) - 'A');
+  /* FIXME: hard code to use &~0x20 as we already know it is a letter */
+  if (!isdigit(tokenizer->ptr[1]))
+    return toupper(*tokenizer->ptr) - 'A';
+  else {
+    /* One day we'll need long vars and brains, until then.. */
+    return (toupper(*tokenizer->ptr) - '@') * 11 + tokenizer->ptr[1] - '0';
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ *	A crunched program is a stream of one byte tokens. Numbers and
+ *	variables are followed by a 16bit little endian value (the variable
+ *	number for the latter), strings by a 16bit length and then the bytes
+ *	of the string. Spaces and the text of REM statements are dropped and
+ *	the stream ends with a zero byte.
+ *
+ *	A constant line number after GO TO, GO SUB or THEN becomes a LINEREF
+ *	carrying the line number and then a 32bit offset of the target line
+ *	from the start of the stream, filled in once the lines are indexed.
+ */
+static uint16_t operand(void)
+{
+  return ((uint8_t)tokenizer->ptr[1]) | (((uint8_t)tokenizer->ptr[2]) << 8);
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t get_crunched_token(void)
+{
+  uint8_t t = *tokenizer->ptr;
+  uint16_t d;
+
+  tokenizer->nextptr = tokenizer->ptr + 1;
+  switch(t) {
+  case 0:
+    return TOKENIZER_ENDOFINPUT;
+  case TOKENIZER_IF:
+  case TOKENIZER_REM:
+  case TOKENIZER_DATA:
+    d = operand();
+    tokenizer->skip = d ? tokenizer->ptr + d : NULL;
+    tokenizer->nextptr += 2;
+    break;
+  case TOKENIZER_STRING:
+    tokenizer->nextptr += 2 + operand();
+    break;
+  case TOKENIZER_LINEREF:
+    tokenizer->nextptr += 6;
+    break;
+  case TOKENIZER_NUMBER:
+  case TOKENIZER_INTVAR:
+  case TOKENIZER_STRINGVAR:
+    tokenizer->nextptr += 2;
+    break;
+  }
+  return t;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t jump_number(uint8_t prev, uint8_t prev2)
+{
+  char const *p = tokenizer->ptr, *np = tokenizer->nextptr;
+  uint8_t t;
+
+  if (prev != TOKENIZER_THEN &&
+      (prev2 != TOKENIZER_GO ||
+       (prev != TOKENIZER_TO && prev != TOKENIZER_SUB)))
+    return 0;
+  /* Only if the number is the whole expression */
+  tokenizer->ptr = tokenizer->nextptr;
+  while(*tokenizer->ptr == ' ')
+    ++tokenizer->ptr;
+  t = get_next_token();
+  tokenizer->ptr = p;
+  tokenizer->nextptr = np;
+  return t == TOKENIZER_NL || t == TOKENIZER_COLON;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ *	IF, REM and DATA carry the distance to the end of their line so the
+ *	interpreter can skip the rest of it in one go. Nought means it was
+ *	too far, or there were too many on the line, and the line is walked.
+ */
+#define CRUNCH_SKIPS	8
+
+static unsigned int crunch(const char *program, uint8_t *out)
+{
+  unsigned int len = 0;
+  unsigned int n, v = 0;
+  unsigned int skips[CRUNCH_SKIPS], nskip = 0, d;
+  uint8_t t, prev = 0, prev2 = 0;
+
+  tokenizer->ptr = program;
+  do {
+    while(*tokenizer->ptr == ' ')
+      ++tokenizer->ptr;
+    t = get_next_token();
+    /* A literal too long for its 16bit length is as bad as any token */
+    if (t == TOKENIZER_STRING && tokenizer->nextptr - tokenizer->ptr - 2 > 0xFFFF)
+      t = TOKENIZER_ERROR;
+    n = 0;
+    switch(t) {
+    case TOKENIZER_ENDOFINPUT:
+      t = 0;
+      break;
+    case TOKENIZER_ERROR:
+      /* Leave the error for the interpreter to report if it ever gets
+         here, and resume crunching at the end of the line */
+      tokenizer->nextptr = tokenizer->ptr;
+      while(*tokenizer->nextptr && *tokenizer->nextptr != '\n' && *tokenizer->nextptr != '\r')
+        ++tokenizer->nextptr;
+      break;
+    case TOKENIZER_REM:
+      while(*tokenizer->nextptr && *tokenizer->nextptr != '\n' && *tokenizer->nextptr != '\r')
+        ++tokenizer->nextptr;
+      /* Fall through */
+    case TOKENIZER_IF:
+    case TOKENIZER_DATA:
+      if (nskip < CRUNCH_SKIPS)
+        skips[nskip++] = len;
+      v = 0;
+      n = 2;
+      break;
+    case TOKENIZER_NUMBER:
+      v = raw_num();
+      n = 2;
+      if (jump_number(prev, prev2)) {
+        t = TOKENIZER_LINEREF;
+        n = 6;
+      }
+      break;
+    case TOKENIZER_INTVAR:
+    case TOKENIZER_STRINGVAR:
+      v = raw_variable_num();
+      n = 2;
+      break;
+    case TOKENIZER_STRING:
+      v = tokenizer->nextptr - tokenizer->ptr - 2;
+      n = 2 + v;
+      break;
+    }
+    if (out) {
+      out[len] = t;
+      if (n) {
+        out[len + 1] = v;
+        out[len + 2] = v >> 8;
+      }
+      if (t == TOKENIZER_STRING)
+        memcpy(out + len + 3, tokenizer->ptr + 1, v);
+      if (t == TOKENIZER_LINEREF)	/* Unresolved */
+        memset(out + len + 3, 0xFF, 4);
+      if (t == TOKENIZER_NL || t == 0) {
+        while(nskip) {
+          d = len - skips[--nskip];
+          if (d <= 0xFFFF) {
+            out[skips[nskip] + 1] = d;
+            out[skips[nskip] + 2] = d >> 8;
+          }
+        }
+      }
+    }
+    if (t == TOKENIZER_NL)
+      nskip = 0;
+    len += 1 + n;
+    tokenizer->ptr = tokenizer->nextptr;
+    prev2 = prev;
+    prev = t;
+  } while(t);
+  return len;
+}
+/*---------------------------------------------------------------------------*/
+char *tokenizer_crunch(const char *program, unsigned int *len)
+{
+  uint8_t *out;
+
+  *len = crunch(program, NULL);
+  out = malloc(*len);
+  if (out != NULL)
+    crunch(program, out);
+  return (char *)out;
+}
+/*---------------------------------------------------------------------------*/
+/* Whether len bytes are a whole crunched stream, with every operand inside
+   it and every IF, REM and DATA skip landing on the end of its line. Sets
+   the bit in starts for the offset of each line. For program images, which
+   come from outside */
+int tokenizer_check_crunched(const char *program, unsigned long len,
+                             uint8_t *starts)
+{
+  const char *end = program + len - 1;
+  const char *skips[CRUNCH_SKIPS];
+  unsigned int nskip = 0;
+  unsigned long pos;
+  uint8_t t;
+
+  if (len == 0 || *end != 0)
+    return 0;
+  starts[0] |= 1;
+  tokenizer->ptr = program;
+  for (;;) {
+    tokenizer->skip = NULL;
+    t = get_crunched_token();
+    if (t == TOKENIZER_NL || t == TOKENIZER_ENDOFINPUT)
+      while(nskip)
+        if (skips[--nskip] != tokenizer->ptr)
+          return 0;
+    if (t == TOKENIZER_ENDOFINPUT)
+      return tokenizer->ptr == end;
+    if (tokenizer->nextptr > end)
+      return 0;
+    if (tokenizer->skip) {
+      if (nskip == CRUNCH_SKIPS)
+        return 0;
+      skips[nskip++] = tokenizer->skip;
+    }
+    if (t == TOKENIZER_NL) {
+      pos = tokenizer->nextptr - program;
+      starts[pos / 8] |= 1 << (pos % 8);
+    }
+    tokenizer->ptr = tokenizer->nextptr;
+  }
+}
+/*---------------------------------------------------------------------------*/
 void tokenizer_goto(const char *program)
 {
-  ptr = program;
-  current_token = get_next_token();
+  tokenizer->ptr = program;
+  if (tokenizer->crunched)
+    current_token = get_crunched_token();
+  else
+    current_token = get_next_token();
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_init(const char *program)
 {
+  tokenizer->crunched = 0;
+  tokenizer_goto(program);
+}
+/*---------------------------------------------------------------------------*/
+void tokenizer_init_crunched(const char *program)
+{
+  tokenizer->crunched = 1;
+  tokenizer->program_base = program;
   tokenizer_goto(program);
-  current_token = get_next_token();
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_push(void)
 {
-  saved_ptr = ptr;
-  saved_next = nextptr;
-  saved_token = current_token;
+  tokenizer->saved_ptr = tokenizer->ptr;
+  tokenizer->saved_next = tokenizer->nextptr;
+  tokenizer->saved_token = current_token;
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_pop(void)
 {
-  ptr = saved_ptr;
-  nextptr = saved_next;
-  current_token = saved_token;
+  tokenizer->ptr = tokenizer->saved_ptr;
+  tokenizer->nextptr = tokenizer->saved_next;
+  current_token = tokenizer->saved_token;
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_next(void)
@@ -244,15 +518,22 @@ void tokenizer_next(void)
     return;
   }
 
-  DEBUG_PRINTF("tokenizer_next: %p\n", nextptr);
-  ptr = nextptr;
+  DEBUG_PRINTF("tokenizer_next: %p\n", tokenizer->nextptr);
+  tokenizer->ptr = tokenizer->nextptr;
+  if (tokenizer->counting)
+    tokenizer->tokens++;
+
+  if (tokenizer->crunched) {
+    current_token = get_crunched_token();
+    return;
+  }
 
-  while(*ptr == ' ') {
-    ++ptr;
+  while(*tokenizer->ptr == ' ') {
+    ++tokenizer->ptr;
   }
   current_token = get_next_token();
 
-  DEBUG_PRINTF("tokenizer_next: '%s' %d\n", ptr, current_token);
+  DEBUG_PRINTF("tokenizer_next: '%s' %d\n", tokenizer->ptr, current_token);
   return;
 }
 
@@ -260,16 +541,38 @@ void tokenizer_next(void)
 
 void tokenizer_newline(void)
 {
-   while(!(*nextptr == '\n' || *nextptr == '\r' || tokenizer_finished())) {
-     ++nextptr;
+  if (current_token == TOKENIZER_NL)
+    return;
+  if (tokenizer->crunched) {
+    /* Operands may contain any byte so walk the tokens */
+    while(current_token != TOKENIZER_NL && !tokenizer_finished())
+      tokenizer_next();
+    return;
+  }
+  while(!(*tokenizer->nextptr == '\n' || *tokenizer->nextptr == '\r' || tokenizer_finished())) {
+     ++tokenizer->nextptr;
   }
   tokenizer_next();
 }
 
+/*---------------------------------------------------------------------------*/
+/* Straight to the end of the line of the IF, REM or DATA just read */
+void tokenizer_skip_line(void)
+{
+  if (tokenizer->crunched && tokenizer->skip) {
+    tokenizer->ptr = tokenizer->skip;
+    current_token = get_crunched_token();
+    return;
+  }
+  tokenizer_newline();
+}
+
 /*---------------------------------------------------------------------------*/
 value_t tokenizer_num(void)
 {
-  return atoi(ptr);
+  if (tokenizer->crunched)
+    return operand();
+  return raw_num();
 }
 /*---------------------------------------------------------------------------*/
 int tokenizer_string_len(void)
@@ -280,18 +583,22 @@ int tokenizer_string_len(void)
     write(2, "strlbotch\n", 10);
     exit(1);
   }
-  string_end = strchr(ptr + 1, '"');
+  if (tokenizer->crunched)
+    return operand();
+  string_end = strchr(tokenizer->ptr + 1, '"');
   /* Pass -1 back so we can keep the notional split between the tokenizer
      and core code cleaner */
   if(string_end == NULL)
     ubasic_tokenizer_error();
-  return string_end - ptr - 1;
+  return string_end - tokenizer->ptr - 1;
 }
 
 /*---------------------------------------------------------------------------*/
 char const *tokenizer_string(void)
 {
-  return ptr + 1;
+  if (tokenizer->crunched)
+    return tokenizer->ptr + 3;
+  return tokenizer->ptr + 1;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -302,14 +609,44 @@ void tokenizer_string_func(stringfunc_t func, void *ctx)
   if(current_token != TOKENIZER_STRING) {
     return;
   }
-  p = ptr + 1;
-  string_end = strchr(p, '"');
-  if(string_end == NULL)
-    ubasic_tokenizer_error();
+  if (tokenizer->crunched) {
+    p = tokenizer->ptr + 3;
+    string_end = p + operand();
+  } else {
+    p = tokenizer->ptr + 1;
+    string_end = strchr(p, '"');
+    if(string_end == NULL)
+      ubasic_tokenizer_error();
+  }
   while(p != string_end)
     func(*p++, ctx);
 }
 
+/*---------------------------------------------------------------------------*/
+char const *tokenizer_lineref(void)
+{
+  const uint8_t *p = (const uint8_t *)tokenizer->ptr + 3;
+  uint32_t offset = p[0] | ((uint16_t)p[1] << 8) |
+                    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+
+  if (offset == 0xFFFFFFFFUL)
+    return NULL;
+  return tokenizer->program_base + offset;
+}
+
+/*---------------------------------------------------------------------------*/
+void tokenizer_set_lineref(char const *target)
+{
+  /* The crunched stream is ours to patch */
+  uint8_t *p = (uint8_t *)tokenizer->ptr + 3;
+  uint32_t offset = target - tokenizer->program_base;
+
+  p[0] = offset;
+  p[1] = offset >> 8;
+  p[2] = offset >> 16;
+  p[3] = offset >> 24;
+}
+
 /*---------------------------------------------------------------------------*/
 void tokenizer_error_print(void)
 {
@@ -318,23 +655,28 @@ void tokenizer_error_print(void)
 /*---------------------------------------------------------------------------*/
 int tokenizer_finished(void)
 {
-  return *ptr == 0 || current_token == TOKENIZER_ENDOFINPUT;
+  return *tokenizer->ptr == 0 || current_token == TOKENIZER_ENDOFINPUT;
 }
 /*---------------------------------------------------------------------------*/
 int tokenizer_variable_num(void)
 {
-  if (ptr[1] == '$')
-    return STRINGFLAG | (toupper(*ptr) - 'A');
-  /* FIXME: hard code to use &~0x20 as we already know it is a letter */
-  if (!isdigit(ptr[1]))
-    return toupper(*ptr) - 'A';
-  else {
-    /* One day we'll need long vars and brains, until then.. */
-    return (toupper(*ptr) - '@') * 11 + ptr[1] - '0';
-  }
+  if (tokenizer->crunched)
+    return operand();
+  return raw_variable_num();
 }
 /*---------------------------------------------------------------------------*/
 char const *tokenizer_pos(void)
 {
-    return ptr;
+    return tokenizer->ptr;
 }
+/*---------------------------------------------------------------------------*/
+const char *tokenizer_token_name(int token)
+{
+  struct keyword_token const *kt;
+
+  for(kt = keywords; kt->keyword != NULL; ++kt)
+    if (kt->token == token)
+      return kt->keyword;
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
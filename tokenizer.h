@@ -70,6 +70,12 @@
 #define TOKENIZER_OR		((uint8_t)159)
 #define TOKENIZER_AT		((uint8_t)160)
 #define TOKENIZER_CLS		((uint8_t)161)
+#define TOKENIZER_LINEREF	((uint8_t)162)	/* Crunched constant jump */
+#define TOKENIZER_READ		((uint8_t)163)
+#define TOKENIZER_MAT		((uint8_t)164)
+#define TOKENIZER_ZER		((uint8_t)165)
+#define TOKENIZER_CON		((uint8_t)166)
+#define TOKENIZER_IDN		((uint8_t)167)
 #define TOKENIZER_NUMBER	((uint8_t)192)	/* Numeric expression types */
 #define TOKENIZER_INTVAR	((uint8_t)193)
 #define TOKENIZER_PEEK		((uint8_t)194)
@@ -113,22 +119,46 @@
 #define STRINGFLAG	0x8000
 #define ARRAYFLAG	0x4000
 
+struct tokenizer_state {
+  char const *ptr, *nextptr;
+  char const *saved_ptr, *saved_next;
+  int saved_token;
+  uint8_t token;
+  uint8_t crunched;		/* Walking a crunched token stream not text */
+  char const *program_base;
+  char const *skip;		/* End of the line of the last IF, REM, DATA */
+  uint8_t counting;		/* Keep count of the tokens read */
+  unsigned long tokens;		/* Read so far */
+};
+
+/* The tokenizer works on whichever state this points at */
+extern UBASIC_TLS struct tokenizer_state *tokenizer;
+#define current_token	(tokenizer->token)
+
 typedef void (*stringfunc_t)(char c, void *ctx);
 void tokenizer_goto(const char *program);
 void tokenizer_init(const char *program);
+void tokenizer_init_crunched(const char *program);
+int tokenizer_check_crunched(const char *program, unsigned long len,
+                             uint8_t *starts);
+char *tokenizer_crunch(const char *program, unsigned int *len);
 void tokenizer_next(void);
 void tokenizer_newline(void);
-extern uint8_t current_token;
+void tokenizer_skip_line(void);
 value_t tokenizer_num(void);
 int tokenizer_variable_num(void);
 char const *tokenizer_string(void);
 int tokenizer_string_len(void);
 void tokenizer_string_func(stringfunc_t func, void *ctx);
+char const *tokenizer_lineref(void);
+void tokenizer_set_lineref(char const *target);
 void tokenizer_push(void);
 void tokenizer_pop(void);
 int tokenizer_finished(void);
 void tokenizer_error_print(void);
 
 char const *tokenizer_pos(void);
+const char *tokenizer_token_name(int token);
+uint8_t tokenizer_keyword(const char *text, char const **next);
 
 #endif /* __TOKENIZER_H__ */
@@ -49,108 +49,373 @@
 #include <time.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <setjmp.h>
 
 #include "ubasic.h"
 #include "tokenizer.h"
 
-static char const *program_ptr;
 
-#define MAX_GOSUB_STACK_DEPTH 10
-static char const *gosub_stack[MAX_GOSUB_STACK_DEPTH];
-static int gosub_stack_ptr;
+struct gosub_state {
+  char const *resume_token;	/* Token to resume execution at */
+  line_t line;			/* and the line it is on */
+  unsigned int fors;		/* FOR loops open at the GOSUB */
+};
 
 struct for_state {
   char const *resume_token;	/* Token to resume execution at */
+  value_t *var;			/* The loop variable itself */
+  line_t line;
   var_t for_variable;
   value_t to;
   value_t step;
+  uint8_t down;			/* Counting down so stop below to */
 };
 
-#define MAX_FOR_STACK_DEPTH 4
-static struct for_state for_stack[MAX_FOR_STACK_DEPTH];
-static int for_stack_ptr;
-
+/* Built when the program is loaded and kept sorted by line number */
 struct line_index {
   line_t line_number;
-  char const *program_text_position;
-  struct line_index *next;
+  uint32_t offset;		/* From the start of the program */
+};
+
+/* DATA is decoded when the program is loaded. Strings are kept BASIC
+   style in a pool and referred to by offset so the table can be saved */
+struct data_item {
+  uint32_t v;			/* Number, or where the string is in the pool */
+  uint8_t type;			/* TYPE_INTEGER, TYPE_STRING or 0 if bad */
 };
-struct line_index *line_index_head = NULL;
-struct line_index *line_index_current = NULL;
 
 #define MAX_VARNUM 26 * 11
 #define MAX_SUBSCRIPT 2
+
+/* An array, laid out when it is DIMensioned. The elements follow in the
+   same allocation, packed and in row major order */
+struct array {
+  uint8_t nsubs;
+  uint8_t size;			/* Of an element */
+  value_t base;			/* OPTION BASE at the DIM */
+  unsigned int extent[MAX_SUBSCRIPT];
+  unsigned int stride[MAX_SUBSCRIPT];
+  unsigned int count;
+  union {
+    value_t *i;
+    uint8_t **p;
+  } e;
+};
 #define MAX_STRING 26
 #define MAX_ARRAY 26
-static value_t variables[MAX_VARNUM];
-static uint8_t *vararrays[MAX_ARRAY];	/* Could union with variables FIXME ?*/
-static value_t variablesubs[MAX_ARRAY];
-static value_t vardim[MAX_ARRAY][MAX_SUBSCRIPT];
-static uint8_t *strings[MAX_STRING];
-static value_t stringsubs[MAX_STRING];
-static value_t stringdim[MAX_STRING][MAX_SUBSCRIPT];
+
+#define STRING_CHUNK	512	/* Must hold the longest string */
+
+struct string_chunk {
+  struct string_chunk *next;
+  uint8_t data[STRING_CHUNK];
+};
+
+#define STRING_CLASSES	6	/* 8, 16 .. 256 bytes */
+
+/*
+ *	Everything belonging to one running program. Nothing here is shared
+ *	so each thread can drive its own interpreters; the one being worked
+ *	on is set by every entry point.
+ */
+struct ubasic_ctx {
+  struct tokenizer_state tok;
+  char const *program_ptr;
+  char *crunched;
+  unsigned int crunched_len;
+  line_t line_num;
+  int ended;
+  uint8_t midline;		/* Next token starts a statement not a line */
+  const char *error;		/* Why we stopped, if we failed */
+  jmp_buf *catch;		/* Where errors unwind to */
+
+  /* Grown on demand up to the limits */
+  struct gosub_state *gosub_stack;
+  unsigned int gosub_stack_ptr, gosub_stack_size;
+  unsigned int gosub_limit, gosub_high;
+  struct for_state *for_stack;
+  unsigned int for_stack_ptr, for_stack_size;
+  unsigned int for_limit, for_high;
+
+  struct line_index *line_index;
+  unsigned int line_count;
+  unsigned int line_index_size;
+  uint8_t image;		/* Program and index belong to the host */
+
+  value_t variables[MAX_VARNUM];
+  struct array *arrays[MAX_ARRAY];
+  uint8_t *strings[MAX_STRING];
+  struct array *strarrays[MAX_STRING];
+  unsigned int array_base;
+
+  struct data_item *data;
+  unsigned int data_count, data_size;
+  uint32_t *data_start;		/* First item at or after each indexed line */
+  uint8_t *data_pool;
+  unsigned int data_pool_len, data_pool_size;
+  unsigned int data_next;	/* For READ */
+
+  /* String temporaries */
+  struct string_chunk string_first;
+  struct string_chunk *string_chunk;
+  uint8_t *nextstr;
+  unsigned int string_used;
+  unsigned int string_highwater;
+
+  /* String variable heap */
+  struct string_slab *string_slabs;
+  uint8_t *slab_ptr, *slab_end;
+  uint8_t *string_free_list[STRING_CLASSES];
+  struct ubasic_string_stats string_stats;
+
+  /* Compiled expressions */
+  uint8_t compile;
+  struct compiled_expr *ctable;
+  unsigned int ctable_size, ctable_used;
+  struct code_chunk *code_chunks;
+  uint8_t *code_ptr, *code_end;
+  uint8_t cbuf[512];
+  uint8_t *cp;
+  uint8_t cfail;
+  uint8_t cdepth, cmax;
+
+  /* Output */
+  int chpos;
+  char outbuf[UBASIC_OUTBUF];
+  unsigned int outlen;
+  unsigned int outsize;
+  int outflags;
+  ubasic_sink_t outsink;
+  ubasic_source_t insource;
+  uint8_t quiet;
+
+  /* Profile, one entry per line in line number order */
+  struct ubasic_line_profile *profile;
+  struct ubasic_line_profile *prof_cur;
+  struct ubasic_line_profile *prof_sorted;
+  unsigned long prof_time;
+
+  struct ubasic_stats *stats;	/* Only with UBASIC_STATS */
+  void *user;
+};
+
+static UBASIC_TLS struct ubasic_ctx *ctx;
 static uint8_t nullstr[1] = { 0 };
 
-static int ended;
 
 static void expr(struct typevalue *val);
-static void line_statements(void);
-static void statements(void);
-static uint8_t statementgroup(void);
 static uint8_t statement(void);
-static void index_free(void);
+static void index_build(void);
+static void data_build(void);
+static void profile_init(void);
+static void compile_free(void);
+static void string_free(uint8_t *p);
+static void string_assign(uint8_t **s, uint8_t *p);
+static void string_heap_reset(void);
+static void output_init(void);
+static void output_flush(void);
+static void *find_variable(int varnum, struct typevalue *value,
+                           int nsubs, struct typevalue *subs);
+static void get_variable(int varnum, struct typevalue *value,
+                         int nsubs, struct typevalue *subs);
+static void set_variable(int varnum, struct typevalue *value,
+                         int nsubs, struct typevalue *subs);
+
 
-line_t line_num;
-static const char *data_position;
-static int data_seek;
 
-static unsigned int array_base = 0;
+/*---------------------------------------------------------------------------*/
+/*
+ *	Integer to text without going near printf. The digits are produced
+ *	two at a time from the end of the caller's buffer backwards, which
+ *	halves the divisions. Works for anything up to a long so a wider
+ *	value_t needs nothing extra.
+ */
+
+#define INT_TEXT	(sizeof(long) * 3 + 2)
 
-#if defined(__linux__) || defined(__ia16__)
+static const char digit_pairs[201] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
 
-const char *_itoa(int v)
+static char *uint_text(unsigned long v, char *end)
 {
-  static char buf[16];
-  snprintf(buf, 16, "%d", v);
-  return buf;
+  unsigned int d;
+
+  while(v >= 100) {
+    d = (v % 100) * 2;
+    v /= 100;
+    *--end = digit_pairs[d + 1];
+    *--end = digit_pairs[d];
+  }
+  if (v >= 10) {
+    d = v * 2;
+    *--end = digit_pairs[d + 1];
+    *--end = digit_pairs[d];
+  } else
+    *--end = '0' + v;
+  return end;
 }
 
-const char *_uitoa(int v)
+static char *int_text(long v, char *end)
 {
-  static char buf[16];
-  snprintf(buf, 16, "%u", v);
-  return buf;
+  if (v >= 0)
+    return uint_text(v, end);
+  end = uint_text(-(unsigned long)v, end);
+  *--end = '-';
+  return end;
 }
 
-#endif
 
 /*---------------------------------------------------------------------------*/
-void ubasic_init(const char *program)
+/* Throw away anything left by a previous program */
+static void variables_clear(void)
+{
+  struct array *a;
+  unsigned int i, n;
+
+  for (i = 0; i < MAX_STRING; i++) {
+    if ((a = ctx->strarrays[i]) != NULL) {
+      for (n = 0; n < a->count; n++)
+        string_free(a->e.p[n]);
+      free(a);
+      ctx->strarrays[i] = NULL;
+    }
+    if (ctx->strings[i] != NULL)
+      string_free(ctx->strings[i]);
+    ctx->strings[i] = nullstr;
+  }
+  for (i = 0; i < MAX_ARRAY; i++) {
+    free(ctx->arrays[i]);
+    ctx->arrays[i] = NULL;
+  }
+  memset(ctx->variables, 0, sizeof(ctx->variables));
+  string_heap_reset();
+}
+/*---------------------------------------------------------------------------*/
+static void select_ctx(struct ubasic_ctx *c)
+{
+  ctx = c;
+  tokenizer = &c->tok;
+}
+/*---------------------------------------------------------------------------*/
+static struct ubasic_ctx *ctx_new(int flags)
+{
+  struct ubasic_ctx *c = calloc(1, sizeof(struct ubasic_ctx));
+
+  if (c == NULL)
+    return NULL;
+  select_ctx(c);
+  ctx->string_chunk = &ctx->string_first;
+  ctx->nextstr = ctx->string_first.data;
+  ctx->compile = flags & UBASIC_COMPILE;
+  ctx->quiet = flags & UBASIC_QUIET;
+  ctx->for_limit = UBASIC_FOR_DEPTH;
+  ctx->gosub_limit = UBASIC_GOSUB_DEPTH;
+  variables_clear();
+  output_init();
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+/* Once the program and its index are in place */
+static void ctx_start(const char *program, int flags)
+{
+  ctx->program_ptr = program;
+  if (flags & UBASIC_PROFILE)
+    profile_init();
+  if (flags & UBASIC_STATS)
+    ctx->stats = calloc(1, sizeof(struct ubasic_stats));
+  ctx->tok.counting = ctx->stats != NULL;
+}
+/*---------------------------------------------------------------------------*/
+struct ubasic_ctx *ubasic_init_flags(const char *program, int flags)
+{
+  jmp_buf catch;
+  struct ubasic_ctx *c = ctx_new(flags);
+
+  if (c == NULL)
+    return NULL;
+  /* A program that won't load comes back already failed */
+  if (setjmp(catch) == 0) {
+    ctx->catch = &catch;
+    /* If there isn't the memory to crunch we can still run from the text */
+    if (flags & UBASIC_CRUNCH)
+      ctx->crunched = tokenizer_crunch(program, &ctx->crunched_len);
+    if (ctx->crunched) {
+      program = ctx->crunched;
+      tokenizer_init_crunched(program);
+    } else
+      tokenizer_init(program);
+    ctx->program_ptr = program;
+    index_build();
+    data_build();
+    ctx_start(program, flags);
+  }
+  ctx->catch = NULL;
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+struct ubasic_ctx *ubasic_init(const char *program)
 {
-  int i;
-  program_ptr = program;
-  for_stack_ptr = gosub_stack_ptr = 0;
-  index_free();
-  tokenizer_init(program);
-  data_position = program_ptr;
-  data_seek = 1;
-  ended = 0;
-  for (i = 0; i < MAX_STRING; i++)
-    strings[i] = nullstr;
+  return ubasic_init_flags(program, UBASIC_CRUNCH | UBASIC_COMPILE);
 }
+/*---------------------------------------------------------------------------*/
+void ubasic_free(struct ubasic_ctx *c)
+{
+  struct string_chunk *s;
 
+  if (c == NULL)
+    return;
+  select_ctx(c);
+  output_flush();
+  variables_clear();
+  compile_free();
+  while((s = ctx->string_first.next) != NULL) {
+    ctx->string_first.next = s->next;
+    free(s);
+  }
+  if (!ctx->image) {
+    free(ctx->line_index);
+    free(ctx->data);
+    free(ctx->data_start);
+    free(ctx->data_pool);
+  }
+  free(ctx->crunched);
+  free(ctx->for_stack);
+  free(ctx->gosub_stack);
+  free(ctx->profile);
+  free(ctx->prof_sorted);
+  free(ctx->stats);
+  free(c);
+  ctx = NULL;
+  tokenizer = NULL;
+}
 /*---------------------------------------------------------------------------*/
+/* Report the error and unwind to the entry point, which leaves the
+   program finished. Only a host misusing the API outside of one of
+   those still takes the process down */
 void ubasic_error(const char *err)
 {
-  const char *p;
-  write(2, "\n", 1);
-  if (line_num) {
-    p = _uitoa(line_num);
-    write(2, p, strlen(p));
-    write(2, ": ", 2);
-  }
-  write(2, err, strlen(err));
-  write(2, " error.\n", 8);
+  char buf[INT_TEXT];
+  char *p;
+
+  output_flush();
+  if (!ctx->quiet) {
+    write(2, "\n", 1);
+    if (ctx->line_num) {
+      p = uint_text(ctx->line_num, buf + INT_TEXT);
+      write(2, p, buf + INT_TEXT - p);
+      write(2, ": ", 2);
+    }
+    write(2, err, strlen(err));
+    write(2, " error.\n", 8);
+  }
+  ctx->error = err;
+  ctx->ended = 1;
+  if (ctx->catch)
+    longjmp(*ctx->catch, 1);
   exit(1);
 }
 static const char syntax[] = { "Syntax" };
@@ -159,6 +424,13 @@ static const char divzero[] = { "Division by zero" };
 static const char outofmemory[] = { "Out of memory" };
 static const char badsubscript[] = { "Subscript" };
 static const char redimension[] = { "Redimension" };
+static const char undefinedline[] = { "Undefined line" };
+static const char toolong[] = { "String too long" };
+static const char badimage[] = { "Bad image" };
+static const char outofdata[] = { "Out of DATA" };
+static const char toomanyfor[] = { "FOR too deep" };
+static const char toomanygosub[] = { "GOSUB too deep" };
+static const char mismatch[] = { "Dimension mismatch" };
 
 static void syntax_error(void)
 {
@@ -231,33 +503,134 @@ static void typecheck_same(struct typevalue *l, struct typevalue *r)
     ubasic_error(badtype);
 }
 /*---------------------------------------------------------------------------*/
-static void range_check(struct typevalue *v, value_t top)
+/* Where an element lives. Everything that touches an array comes here */
+static void *array_element(struct array *a, int nsubs, struct typevalue *subs)
 {
-  typecheck_int(v);
-  if (v->d.i > top || v->d.i < array_base)
+  unsigned int off = 0;
+  int i, s;
+
+  if (a == NULL || a->nsubs != nsubs)
     ubasic_error(badsubscript);
+  for (i = 0; i < nsubs; i++) {
+    typecheck_int(subs + i);
+    s = subs[i].d.i - a->base;
+    if (s < 0 || (unsigned int)s >= a->extent[i])
+      ubasic_error(badsubscript);
+    off += s * a->stride[i];
+  }
+  return (uint8_t *)a->e.p + off * a->size;
 }
 /*---------------------------------------------------------------------------*/
-/* Temoporary implementation of string workspaces */
+/*
+ *	String workspace. Temporaries are carved from a chain of chunks, the
+ *	first static and the rest allocated as a statement needs them and
+ *	then kept. Everything goes at the start of each statement, and each
+ *	expression gives back whatever it used apart from its result.
+ */
+
+struct string_mark {
+  struct string_chunk *chunk;
+  uint8_t *next;
+  unsigned int used;
+};
 
-static uint8_t stringblob[512];
-static uint8_t *nextstr;
 
 static uint8_t *string_temp(int len)
 {
-  uint8_t *p = nextstr;
+  struct string_chunk *c;
+  uint8_t *p;
   if (len > 255)
-    ubasic_error("String too long");
-  nextstr += len + 1;
-  if (nextstr > stringblob + sizeof(stringblob))
-    ubasic_error("Out of temporary space");
+    ubasic_error(toolong);
+  if (ctx->nextstr + len + 1 > ctx->string_chunk->data + STRING_CHUNK) {
+    if (ctx->string_chunk->next == NULL) {
+      c = malloc(sizeof(struct string_chunk));
+      if (ctx->stats)
+        ctx->stats->temp_chunks++;
+      if (c == NULL)
+        ubasic_error("Out of temporary space");
+      c->next = NULL;
+      ctx->string_chunk->next = c;
+    }
+    /* The end of the old chunk is lost until the next release */
+    ctx->string_used += ctx->string_chunk->data + STRING_CHUNK - ctx->nextstr;
+    ctx->string_chunk = ctx->string_chunk->next;
+    ctx->nextstr = ctx->string_chunk->data;
+  }
+  if (ctx->stats)
+    ctx->stats->temp_bytes += len + 1;
+  p = ctx->nextstr;
+  ctx->nextstr += len + 1;
+  ctx->string_used += len + 1;
+  if (ctx->string_used > ctx->string_highwater)
+    ctx->string_highwater = ctx->string_used;
   *p = len;
   return p;
 }
 /*---------------------------------------------------------------------------*/
 static void string_temp_free(void)
 {
-  nextstr = stringblob;
+  ctx->string_chunk = &ctx->string_first;
+  ctx->nextstr = ctx->string_first.data;
+  ctx->string_used = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void string_temp_mark(struct string_mark *m)
+{
+  m->chunk = ctx->string_chunk;
+  m->next = ctx->nextstr;
+  m->used = ctx->string_used;
+}
+/*---------------------------------------------------------------------------*/
+static void string_temp_release(struct string_mark *m)
+{
+  ctx->string_chunk = m->chunk;
+  ctx->nextstr = m->next;
+  ctx->string_used = m->used;
+}
+/*---------------------------------------------------------------------------*/
+/* Release back to the mark but keep the string value v. If it is a
+   temporary made since the mark it is moved down to the mark */
+static void string_temp_keep(struct string_mark *m, struct typevalue *v)
+{
+  struct string_chunk *c = m->chunk;
+  uint8_t *p = v->d.p;
+  uint8_t *base = m->next;
+
+  for(;;) {
+    if (p >= base && p < c->data + STRING_CHUNK)
+      break;
+    if (c == ctx->string_chunk) {
+      /* Not one of ours */
+      string_temp_release(m);
+      return;
+    }
+    c = c->next;
+    base = c->data;
+  }
+  string_temp_release(m);
+  /* Always at or below where it was, so the copy is safe */
+  v->d.p = string_temp(*p);
+  memmove(v->d.p + 1, p + 1, *p);
+}
+/*---------------------------------------------------------------------------*/
+unsigned int ubasic_string_highwater(struct ubasic_ctx *c)
+{
+  select_ctx(c);
+  return ctx->string_highwater;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_set_stack_limits(struct ubasic_ctx *c, unsigned int fors,
+                             unsigned int gosubs)
+{
+  c->for_limit = fors;
+  c->gosub_limit = gosubs;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_stack_highwater(struct ubasic_ctx *c, unsigned int *fors,
+                            unsigned int *gosubs)
+{
+  *fors = c->for_high;
+  *gosubs = c->gosub_high;
 }
 /*---------------------------------------------------------------------------*/
 static void string_cut(struct typevalue *o, struct typevalue *t, value_t l, value_t n)
@@ -289,6 +662,18 @@ static void string_cut_r(struct typevalue *o, struct typevalue *t, value_t r)
     string_cut(o, t, f + 1, r);
 }
 /*---------------------------------------------------------------------------*/
+static int string_compare(uint8_t *l, uint8_t *r)
+{
+  int n = *l;
+  if (*r < n)
+    n = *r;
+  n = memcmp(l + 1, r + 1, n);
+  if (n == 0)
+    n = *l - *r;
+  /* memcmp only promises the sign */
+  return n < 0 ? -1 : n > 0;
+}
+/*---------------------------------------------------------------------------*/
 static value_t string_val(struct typevalue *t)
 {
   uint8_t *p = t->d.p;
@@ -355,7 +740,7 @@ static void varfactor(struct typevalue *v)
   accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
   if (current_token == TOKENIZER_LEFTPAREN)
     n = parse_subscripts(s);
-  ubasic_get_variable(var, v, n, s);
+  get_variable(var, v, n, s);
   DEBUG_PRINTF("varfactor: obtaining %d from variable %d\n", v->d.i, tokenizer_variable_num());
 }
 /*---------------------------------------------------------------------------*/
@@ -451,7 +836,7 @@ static void factor(struct typevalue *v)
         break;
       case TOKENIZER_CHRSTR:
         funcexpr(arg, "I");
-        v->d.p = string_temp(2);
+        v->d.p = string_temp(1);
         v->d.p[1] = arg[0].d.i;
         v->type = TYPE_STRING;
         break;
@@ -590,16 +975,7 @@ static void relation(struct typevalue *r1)
         break;
       }
     } else {
-      int n =*r1->d.p;
-      if (*r2.d.p < n)
-        n = *r2.d.p;
-      n = memcmp(r1->d.p + 1, r2.d.p + 1, n);
-      if (n == 0) {
-        if (*r1->d.p > *r2.d.p)
-          n = 1;
-        else if (*r1->d.p < *r2.d.p)
-          n = -1;
-      }
+      int n = string_compare(r1->d.p, r2.d.p);
       switch(op) {
         case TOKENIZER_LT:
           n = (n == -1);
@@ -627,7 +1003,7 @@ static void relation(struct typevalue *r1)
   }
 }
 /*---------------------------------------------------------------------------*/
-static void expr(struct typevalue *r1)
+static void logic_expr(struct typevalue *r1)
 {
   struct typevalue r2;
   int op;
@@ -657,223 +1033,1335 @@ static void expr(struct typevalue *r1)
   }
 }
 /*---------------------------------------------------------------------------*/
-static value_t intexpr(void)
-{
-  struct typevalue t;
-  expr(&t);
-  typecheck_int(&t);
-  return t.d.i;
-}
+/*
+ *	Expression compiler. The first time an expression is evaluated it is
+ *	compiled into code for a small stack machine and the code is cached
+ *	against the position of the expression in the program. From then on
+ *	evaluating it is a hash lookup and a run of the machine rather than a
+ *	trip down expr/relation/mathexpr/term/factor. Types are all known at
+ *	compile time so only the checks that depend on DIM are left to run
+ *	time. Anything that cannot be compiled (out of memory, too deep) is
+ *	simply interpreted as before.
+ */
+
+enum {
+  OP_END,
+  OP_NUM,		/* 16bit value */
+  OP_STR,		/* Length and bytes, pushes a pointer to itself */
+  OP_VAR,		/* 16bit variable number */
+  OP_STRVAR,
+  OP_ARRAY,		/* 16bit variable number, subscript count */
+  OP_LET,		/* 16bit variable number */
+  OP_LETSTR,
+  OP_LETARRAY,		/* 16bit variable number, subscript count */
+  OP_ADD,
+  OP_CONCAT,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_BAND,
+  OP_BOR,
+  OP_LT,
+  OP_GT,
+  OP_EQ,
+  OP_NE,
+  OP_LE,
+  OP_GE,
+  OP_STRCMP,		/* Replaces two strings with -1, 0 or 1 */
+  OP_PEEK,
+  OP_ABS,
+  OP_SGN,
+  OP_LEN,
+  OP_CODE,
+  OP_VAL,
+  OP_LEFTSTR,
+  OP_RIGHTSTR,
+  OP_MIDSTR,
+  OP_CHRSTR
+};
+
+#define VM_STACK_DEPTH	16
+#define CODE_CHUNK	1024
+
+union vmcell {
+  value_t i;
+  uint8_t *p;
+};
+
+struct compiled_expr {
+  char const *site;		/* Position of the expression */
+  char const *end;		/* Token following it */
+  uint8_t *code;		/* NULL if it is interpreted */
+  uint8_t type;
+};
+
+struct code_chunk {
+  struct code_chunk *next;
+};
+
+
+static uint8_t c_expr(void);
+
 /*---------------------------------------------------------------------------*/
-static uint8_t *stringexpr(void)
+static void compile_free(void)
 {
-  struct typevalue t;
-  expr(&t);
-  typecheck_string(&t);
-  return t.d.p;
-}
-/*---------------------------------------------------------------------------*/
-static void index_free(void) {
-  if(line_index_head != NULL) {
-    line_index_current = line_index_head;
-    do {
-      DEBUG_PRINTF("Freeing index for line %p.\n", (void *)line_index_current);
-      line_index_head = line_index_current;
-      line_index_current = line_index_current->next;
-      free(line_index_head);
-    } while (line_index_current != NULL);
-    line_index_head = NULL;
+  struct code_chunk *c;
+  while((c = ctx->code_chunks) != NULL) {
+    ctx->code_chunks = c->next;
+    free(c);
   }
+  ctx->code_ptr = ctx->code_end = NULL;
+  free(ctx->ctable);
+  ctx->ctable = NULL;
+  ctx->ctable_size = ctx->ctable_used = 0;
 }
 /*---------------------------------------------------------------------------*/
-static char const *index_find(int linenum) {
-  #if DEBUG
-  int step = 0;
-  #endif
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-
-  while(lidx != NULL && lidx->line_number != linenum) {
-    lidx = lidx->next;
-
-    #if DEBUG
-    if(lidx != NULL) {
-      DEBUG_PRINTF("index_find: Step %3d. Found index for line %d: %p.\n",
-                   step, lidx->line_number,
-                   lidx->program_text_position);
+static struct compiled_expr *compiled_find(char const *site)
+{
+  struct compiled_expr *ce, *old = ctx->ctable;
+  unsigned int i, size = ctx->ctable_size;
+
+  if (2 * ctx->ctable_used >= ctx->ctable_size) {
+    ce = calloc(size ? 2 * size : 64, sizeof(struct compiled_expr));
+    if (ce == NULL)
+      return NULL;
+    ctx->ctable = ce;
+    ctx->ctable_size = size ? 2 * size : 64;
+    for (i = 0; i < size; i++) {
+      if (old[i].site) {
+        ce = compiled_find(old[i].site);
+        *ce = old[i];
+      }
     }
-    step++;
-    #endif
-  }
-  if(lidx != NULL && lidx->line_number == linenum) {
-    DEBUG_PRINTF("index_find: Returning index for line %d.\n", linenum);
-    return lidx->program_text_position;
+    free(old);
   }
-  DEBUG_PRINTF("index_find: Returning NULL.\n");
-  return NULL;
+  /* Expressions all start at different places so this spreads nicely */
+  i = (uintptr_t)site & (ctx->ctable_size - 1);
+  while(ctx->ctable[i].site != NULL && ctx->ctable[i].site != site)
+    i = (i + 1) & (ctx->ctable_size - 1);
+  return ctx->ctable + i;
 }
 /*---------------------------------------------------------------------------*/
-static void index_add(int linenum, char const* sourcepos) {
-  struct line_index *new_lidx;
-
-  if(line_index_head != NULL && index_find(linenum)) {
-    return;
-  }
-
-  new_lidx = malloc(sizeof(struct line_index));
-  new_lidx->line_number = linenum;
-  new_lidx->program_text_position = sourcepos;
-  new_lidx->next = NULL;
-
-  if(line_index_head != NULL) {
-    line_index_current->next = new_lidx;
-    line_index_current = line_index_current->next;
-  } else {
-    line_index_current = new_lidx;
-    line_index_head = line_index_current;
+static uint8_t *code_save(unsigned int len)
+{
+  struct code_chunk *c;
+  uint8_t *p;
+
+  if (ctx->code_end - ctx->code_ptr < len) {
+    c = malloc(sizeof(struct code_chunk) + CODE_CHUNK);
+    if (c == NULL)
+      return NULL;
+    c->next = ctx->code_chunks;
+    ctx->code_chunks = c;
+    ctx->code_ptr = (uint8_t *)(c + 1);
+    ctx->code_end = ctx->code_ptr + CODE_CHUNK;
   }
-  DEBUG_PRINTF("index_add: Adding index for line %d: %p.\n", linenum,
-               sourcepos);
+  p = ctx->code_ptr;
+  memcpy(p, ctx->cbuf, len);
+  ctx->code_ptr += len;
+  return p;
 }
 /*---------------------------------------------------------------------------*/
-static void
-jump_linenum_slow(int linenum)
+static void emit(uint8_t b)
 {
-  tokenizer_init(program_ptr);
-  while(tokenizer_num() != linenum) {
-    do {
-      do {
-        tokenizer_next();
-      } while(current_token != TOKENIZER_NL &&
-          current_token != TOKENIZER_ENDOFINPUT);
-      if(current_token == TOKENIZER_NL) {
-        tokenizer_next();
-      }
-    } while(current_token != TOKENIZER_NUMBER);
-    DEBUG_PRINTF("jump_linenum_slow: Found line %d\n", tokenizer_num());
-  }
+  if (ctx->cp == ctx->cbuf + sizeof(ctx->cbuf))
+    ctx->cfail = 1;
+  else
+    *ctx->cp++ = b;
 }
 /*---------------------------------------------------------------------------*/
-static void
-jump_linenum(int linenum)
+static void emit16(uint16_t v)
 {
-  char const* pos = index_find(linenum);
-  if(pos != NULL) {
-    DEBUG_PRINTF("jump_linenum: Going to line %d.\n", linenum);
-    tokenizer_goto(pos);
-  } else {
-    /* We'll try to find a yet-unindexed line to jump to. */
-    DEBUG_PRINTF("jump_linenum: Calling jump_linenum_slow %d.\n", linenum);
-    jump_linenum_slow(linenum);
-  }
+  emit(v);
+  emit(v >> 8);
 }
 /*---------------------------------------------------------------------------*/
-static void go_statement(void)
+/* Emit an operation and account for what it does to the stack depth */
+static void emit_op(uint8_t op, int8_t depth)
 {
-  int linenum;
-  uint8_t t;
-
-  t = accept_either(TOKENIZER_TO, TOKENIZER_SUB);
-  if (t == TOKENIZER_TO) {
-    linenum = intexpr();
-    DEBUG_PRINTF("go_statement: go to %d.\n", linenum);
-    if (!statement_end())
-      syntax_error();
-    DEBUG_PRINTF("go_statement: jumping.\n");
-    jump_linenum(linenum);
-    return;
-  }
-  linenum = intexpr();
-  if (!statement_end())
-    syntax_error();
-
-  if(gosub_stack_ptr < MAX_GOSUB_STACK_DEPTH) {
-    gosub_stack[gosub_stack_ptr] = tokenizer_pos();
-    gosub_stack_ptr++;
-    jump_linenum(linenum);
-  } else {
-    DEBUG_PRINTF("gosub_statement: gosub stack exhausted\n");
-    ubasic_error("Return without gosub");
-  }
+  emit(op);
+  ctx->cdepth += depth;
+  if (ctx->cdepth > ctx->cmax)
+    ctx->cmax = ctx->cdepth;
 }
 /*---------------------------------------------------------------------------*/
-
-static int chpos = 0;
-
-static void charout(char c, void *unused)
+static void c_funcexpr(const char *f)
 {
-#ifdef __ia16__
-  static char cr = '\r';
-#endif
-  if (c == '\t') {
-    do {
-      charout(' ', NULL);
-    } while(chpos%8);
-    return;
+  accept_tok(TOKENIZER_LEFTPAREN);
+  while(*f) {
+    if (c_expr() != *f)
+      ubasic_error(badtype);
+    if (*++f)
+      accept_tok(TOKENIZER_COMMA);
   }
-#ifdef __ia16__
-  if (c == '\n')
-    write(1, &cr, 1);
-#endif
-  /* FIMXE: line buffer ! */
-  write(1, &c, 1);
-  if ((c == 8 || c== 127) && chpos)
-    chpos--;
-  else if (c == '\r' || c == '\n')
-    chpos = 0;
-  else
-    chpos++;
+  accept_tok(TOKENIZER_RIGHTPAREN);
 }
-
-static void charreset(void)
+/*---------------------------------------------------------------------------*/
+/* A DIM'd name must always be subscripted. Compiled code does not check
+   again so DIM throws away all the code compiled so far. Nor does it check
+   the variable number, so refuse any that find_variable would */
+static void scalar_check(var_t var)
 {
-  chpos = 0;
+  if (var & STRINGFLAG) {
+    if (ctx->strarrays[var & ~STRINGFLAG])
+      ubasic_error(badsubscript);
+  } else if (var >= MAX_VARNUM)
+    ubasic_error("badv");
+  else if (var < MAX_ARRAY && ctx->arrays[var])
+    ubasic_error(badsubscript);
 }
-
-static void chartab(value_t v)
+/*---------------------------------------------------------------------------*/
+static int c_subscripts(void)
 {
-  if (v < 1)
-    v = 1;
-  if (chpos >= v)
-    charout('\n', NULL);
-  while(chpos < v - 1)
-    charout(' ', NULL);
-}
+  int n = 0;
 
-static void charoutstr(uint8_t *p)
-{
-  int len =*p++;
-  while(len--)
-    charout(*p++, NULL);
+  accept_tok(TOKENIZER_LEFTPAREN);
+  do {
+    if (c_expr() != TYPE_INTEGER)
+      ubasic_error(badtype);
+    n++;
+  } while(n < MAX_SUBSCRIPT &&
+          accept_either(TOKENIZER_COMMA, TOKENIZER_RIGHTPAREN) == TOKENIZER_COMMA);
+  if (n == MAX_SUBSCRIPT)
+    accept_tok(TOKENIZER_RIGHTPAREN);
+  return n;
 }
-
-static void intout(value_t v)
+/*---------------------------------------------------------------------------*/
+static uint8_t c_varfactor(void)
 {
-  const char *p = _itoa(v);
-  while(*p)
-    charout(*p++, NULL);
+  var_t var = tokenizer_variable_num();
+  int n;
+
+  accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
+  if (current_token == TOKENIZER_LEFTPAREN) {
+    n = c_subscripts();
+    emit_op(OP_ARRAY, 1 - n);
+    emit16(var);
+    emit(n);
+  } else {
+    scalar_check(var);
+    emit_op((var & STRINGFLAG) ? OP_STRVAR : OP_VAR, 1);
+    emit16(var);
+  }
+  return (var & STRINGFLAG) ? TYPE_STRING : TYPE_INTEGER;
 }
+/*---------------------------------------------------------------------------*/
+static uint8_t c_factor(void)
+{
+  uint8_t t = current_token;
+  const char *p;
+  int len;
 
-static void print_statement(void)
+  switch(t) {
+  case TOKENIZER_STRING:
+    len = tokenizer_string_len();
+    if (len > 255)
+      ubasic_error(toolong);
+    emit_op(OP_STR, 1);
+    emit(len);
+    p = tokenizer_string();
+    while(len--)
+      emit(*p++);
+    accept_tok(TOKENIZER_STRING);
+    return TYPE_STRING;
+  case TOKENIZER_NUMBER:
+    emit_op(OP_NUM, 1);
+    emit16(tokenizer_num());
+    accept_tok(TOKENIZER_NUMBER);
+    return TYPE_INTEGER;
+  case TOKENIZER_LEFTPAREN:
+    accept_tok(TOKENIZER_LEFTPAREN);
+    t = c_expr();
+    accept_tok(TOKENIZER_RIGHTPAREN);
+    return t;
+  case TOKENIZER_INTVAR:
+  case TOKENIZER_STRINGVAR:
+    return c_varfactor();
+  }
+  accept_tok(t);
+  switch(t) {
+  case TOKENIZER_PEEK:
+    c_funcexpr("I");
+    emit_op(OP_PEEK, 0);
+    break;
+  case TOKENIZER_ABS:
+    c_funcexpr("I");
+    emit_op(OP_ABS, 0);
+    break;
+  case TOKENIZER_INT:
+    c_funcexpr("I");
+    break;
+  case TOKENIZER_SGN:
+    c_funcexpr("I");
+    emit_op(OP_SGN, 0);
+    break;
+  case TOKENIZER_LEN:
+    c_funcexpr("S");
+    emit_op(OP_LEN, 0);
+    break;
+  case TOKENIZER_CODE:
+    c_funcexpr("S");
+    emit_op(OP_CODE, 0);
+    break;
+  case TOKENIZER_VAL:
+    c_funcexpr("S");
+    emit_op(OP_VAL, 0);
+    break;
+  case TOKENIZER_LEFTSTR:
+    c_funcexpr("SI");
+    emit_op(OP_LEFTSTR, -1);
+    return TYPE_STRING;
+  case TOKENIZER_RIGHTSTR:
+    c_funcexpr("SI");
+    emit_op(OP_RIGHTSTR, -1);
+    return TYPE_STRING;
+  case TOKENIZER_MIDSTR:
+    c_funcexpr("SII");
+    emit_op(OP_MIDSTR, -2);
+    return TYPE_STRING;
+  case TOKENIZER_CHRSTR:
+    c_funcexpr("I");
+    emit_op(OP_CHRSTR, 0);
+    return TYPE_STRING;
+  default:
+    syntax_error();
+  }
+  return TYPE_INTEGER;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t c_term(void)
 {
-  uint8_t nonl;
-  uint8_t t;
-  uint8_t nv = 0;
+  uint8_t type;
+  uint8_t op;
 
-  do {
-    t = current_token;
-    nonl = 0;
-    DEBUG_PRINTF("Print loop\n");
-    if (nv == 0) {
-      if(t == TOKENIZER_STRING) {
-        /* Handle string const specially - length rules */
-        tokenizer_string_func(charout, NULL);
-        tokenizer_next();
+  type = c_factor();
+  op = current_token;
+  while(op == TOKENIZER_ASTR ||
+       op == TOKENIZER_SLASH ||
+       op == TOKENIZER_MOD) {
+    tokenizer_next();
+    if (c_factor() != TYPE_INTEGER || type != TYPE_INTEGER)
+      ubasic_error(badtype);
+    if (op == TOKENIZER_ASTR)
+      emit_op(OP_MUL, -1);
+    else if (op == TOKENIZER_SLASH)
+      emit_op(OP_DIV, -1);
+    else
+      emit_op(OP_MOD, -1);
+    op = current_token;
+  }
+  return type;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t c_mathexpr(void)
+{
+  uint8_t type;
+  uint8_t op;
+
+  type = c_term();
+  op = current_token;
+  while(op == TOKENIZER_PLUS ||
+       op == TOKENIZER_MINUS ||
+       op == TOKENIZER_BAND ||
+       op == TOKENIZER_BOR) {
+    tokenizer_next();
+    if (c_term() != type || (op != TOKENIZER_PLUS && type != TYPE_INTEGER))
+      ubasic_error(badtype);
+    switch(op) {
+    case TOKENIZER_PLUS:
+      emit_op(type == TYPE_INTEGER ? OP_ADD : OP_CONCAT, -1);
+      break;
+    case TOKENIZER_MINUS:
+      emit_op(OP_SUB, -1);
+      break;
+    case TOKENIZER_BAND:
+      emit_op(OP_BAND, -1);
+      break;
+    case TOKENIZER_BOR:
+      emit_op(OP_BOR, -1);
+      break;
+    }
+    op = current_token;
+  }
+  return type;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t c_relation(void)
+{
+  uint8_t type;
+  uint8_t op;
+
+  type = c_mathexpr();
+  op = current_token;
+  while(op == TOKENIZER_LT ||
+       op == TOKENIZER_GT ||
+       op == TOKENIZER_EQ ||
+       op == TOKENIZER_NE ||
+       op == TOKENIZER_LE ||
+       op == TOKENIZER_GE) {
+    tokenizer_next();
+    if (c_mathexpr() != type)
+      ubasic_error(badtype);
+    /* Strings compare to -1/0/1 which we then compare with 0 */
+    if (type == TYPE_STRING) {
+      emit_op(OP_STRCMP, -1);
+      emit_op(OP_NUM, 1);
+      emit16(0);
+    }
+    switch(op) {
+    case TOKENIZER_LT:
+      emit_op(OP_LT, -1);
+      break;
+    case TOKENIZER_GT:
+      emit_op(OP_GT, -1);
+      break;
+    case TOKENIZER_EQ:
+      emit_op(OP_EQ, -1);
+      break;
+    case TOKENIZER_NE:
+      emit_op(OP_NE, -1);
+      break;
+    case TOKENIZER_LE:
+      emit_op(OP_LE, -1);
+      break;
+    case TOKENIZER_GE:
+      emit_op(OP_GE, -1);
+      break;
+    }
+    type = TYPE_INTEGER;
+    op = current_token;
+  }
+  return type;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t c_expr(void)
+{
+  uint8_t type;
+  uint8_t op;
+
+  type = c_relation();
+  op = current_token;
+  while(op == TOKENIZER_AND ||
+       op == TOKENIZER_OR) {
+    tokenizer_next();
+    if (c_relation() != TYPE_INTEGER || type != TYPE_INTEGER)
+      ubasic_error(badtype);
+    emit_op(op == TOKENIZER_AND ? OP_BAND : OP_BOR, -1);
+    op = current_token;
+  }
+  return type;
+}
+/*---------------------------------------------------------------------------*/
+/* Assignments compile to the expression and a store */
+static uint8_t c_let(void)
+{
+  var_t var = tokenizer_variable_num();
+  uint8_t type = (var & STRINGFLAG) ? TYPE_STRING : TYPE_INTEGER;
+  int n = 0;
+
+  accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
+  if (current_token == TOKENIZER_LEFTPAREN)
+    n = c_subscripts();
+  else
+    scalar_check(var);
+  accept_tok(TOKENIZER_EQ);
+  if (c_expr() != type)
+    ubasic_error(badtype);
+  if (n) {
+    emit_op(OP_LETARRAY, -1 - n);
+    emit16(var);
+    emit(n);
+  } else {
+    emit_op(type == TYPE_STRING ? OP_LETSTR : OP_LET, -1);
+    emit16(var);
+  }
+  return type;
+}
+/*---------------------------------------------------------------------------*/
+#define OPERAND(pc)	((pc)[0] | ((pc)[1] << 8))
+
+#ifdef __GNUC__
+/* Threaded dispatch: jump straight from one operation to the next */
+#define VM_OP(x)	op_##x
+#define VM_NEXT		__extension__ ({ goto *dispatch[*pc++]; })
+#else
+#define VM_OP(x)	case OP_##x
+#define VM_NEXT		break
+#endif
+
+static void vm_run(const uint8_t *pc, struct typevalue *r)
+{
+  union vmcell stack[VM_STACK_DEPTH];
+  union vmcell *sp = stack;
+  struct typevalue t, o, subs[MAX_SUBSCRIPT];
+  unsigned int n;
+#ifdef __GNUC__
+  /* Must match the order of the OP_ values */
+  static const void *const dispatch[] = {
+    __extension__ &&op_END, __extension__ &&op_NUM, __extension__ &&op_STR,
+    __extension__ &&op_VAR, __extension__ &&op_STRVAR,
+    __extension__ &&op_ARRAY, __extension__ &&op_LET,
+    __extension__ &&op_LETSTR, __extension__ &&op_LETARRAY,
+    __extension__ &&op_ADD,
+    __extension__ &&op_CONCAT, __extension__ &&op_SUB,
+    __extension__ &&op_MUL, __extension__ &&op_DIV, __extension__ &&op_MOD,
+    __extension__ &&op_BAND, __extension__ &&op_BOR, __extension__ &&op_LT,
+    __extension__ &&op_GT, __extension__ &&op_EQ, __extension__ &&op_NE,
+    __extension__ &&op_LE, __extension__ &&op_GE,
+    __extension__ &&op_STRCMP, __extension__ &&op_PEEK,
+    __extension__ &&op_ABS, __extension__ &&op_SGN, __extension__ &&op_LEN,
+    __extension__ &&op_CODE, __extension__ &&op_VAL,
+    __extension__ &&op_LEFTSTR, __extension__ &&op_RIGHTSTR,
+    __extension__ &&op_MIDSTR, __extension__ &&op_CHRSTR
+  };
+
+  VM_NEXT;
+#else
+  for(;;) switch(*pc++) {
+#endif
+  VM_OP(END):
+    if (r == NULL)
+      return;
+    if (r->type == TYPE_INTEGER)
+      r->d.i = stack[0].i;
+    else
+      r->d.p = stack[0].p;
+    return;
+  VM_OP(NUM):
+    (sp++)->i = OPERAND(pc);
+    pc += 2;
+    VM_NEXT;
+  VM_OP(STR):
+    (sp++)->p = (uint8_t *)pc;
+    pc += *pc + 1;
+    VM_NEXT;
+  VM_OP(VAR):
+    (sp++)->i = ctx->variables[OPERAND(pc)];
+    pc += 2;
+    VM_NEXT;
+  VM_OP(STRVAR):
+    (sp++)->p = ctx->strings[OPERAND(pc) & ~STRINGFLAG];
+    pc += 2;
+    VM_NEXT;
+  VM_OP(ARRAY):
+    n = pc[2];
+    sp -= n;
+    subs[0].type = subs[1].type = TYPE_INTEGER;
+    subs[0].d.i = sp[0].i;
+    subs[1].d.i = sp[1].i;
+    get_variable(OPERAND(pc), &t, n, subs);
+    pc += 3;
+    if (t.type == TYPE_INTEGER)
+      (sp++)->i = t.d.i;
+    else
+      (sp++)->p = t.d.p;
+    VM_NEXT;
+  VM_OP(LET):
+    ctx->variables[OPERAND(pc)] = (--sp)->i;
+    pc += 2;
+    VM_NEXT;
+  VM_OP(LETSTR):
+    n = OPERAND(pc) & ~STRINGFLAG;
+    pc += 2;
+    string_assign(&ctx->strings[n], (--sp)->p);
+    VM_NEXT;
+  VM_OP(LETARRAY):
+    n = pc[2];
+    sp -= n + 1;
+    subs[0].type = subs[1].type = TYPE_INTEGER;
+    subs[0].d.i = sp[0].i;
+    subs[1].d.i = sp[1].i;
+    if (OPERAND(pc) & STRINGFLAG) {
+      t.type = TYPE_STRING;
+      t.d.p = sp[n].p;
+    } else {
+      t.type = TYPE_INTEGER;
+      t.d.i = sp[n].i;
+    }
+    set_variable(OPERAND(pc), &t, n, subs);
+    pc += 3;
+    VM_NEXT;
+  VM_OP(ADD):
+    sp--;
+    sp[-1].i += sp->i;
+    VM_NEXT;
+  VM_OP(CONCAT):
+    sp--;
+    n = *sp[-1].p;
+    o.d.p = string_temp(n + *sp->p);
+    memcpy(o.d.p + 1, sp[-1].p + 1, n);
+    memcpy(o.d.p + n + 1, sp->p + 1, *sp->p);
+    sp[-1].p = o.d.p;
+    VM_NEXT;
+  VM_OP(SUB):
+    sp--;
+    sp[-1].i -= sp->i;
+    VM_NEXT;
+  VM_OP(MUL):
+    sp--;
+    sp[-1].i *= sp->i;
+    VM_NEXT;
+  VM_OP(DIV):
+    sp--;
+    if (sp->i == 0)
+      ubasic_error(divzero);
+    sp[-1].i /= sp->i;
+    VM_NEXT;
+  VM_OP(MOD):
+    sp--;
+    if (sp->i == 0)
+      ubasic_error(divzero);
+    sp[-1].i %= sp->i;
+    VM_NEXT;
+  VM_OP(BAND):
+    sp--;
+    sp[-1].i &= sp->i;
+    VM_NEXT;
+  VM_OP(BOR):
+    sp--;
+    sp[-1].i |= sp->i;
+    VM_NEXT;
+  VM_OP(LT):
+    sp--;
+    sp[-1].i = sp[-1].i < sp->i;
+    VM_NEXT;
+  VM_OP(GT):
+    sp--;
+    sp[-1].i = sp[-1].i > sp->i;
+    VM_NEXT;
+  VM_OP(EQ):
+    sp--;
+    sp[-1].i = sp[-1].i == sp->i;
+    VM_NEXT;
+  VM_OP(NE):
+    sp--;
+    sp[-1].i = sp[-1].i != sp->i;
+    VM_NEXT;
+  VM_OP(LE):
+    sp--;
+    sp[-1].i = sp[-1].i <= sp->i;
+    VM_NEXT;
+  VM_OP(GE):
+    sp--;
+    sp[-1].i = sp[-1].i >= sp->i;
+    VM_NEXT;
+  VM_OP(STRCMP):
+    sp--;
+    sp[-1].i = string_compare(sp[-1].p, sp->p);
+    VM_NEXT;
+  VM_OP(PEEK):
+    sp[-1].i = peek_function(sp[-1].i);
+    VM_NEXT;
+  VM_OP(ABS):
+    if (sp[-1].i < 0)
+      sp[-1].i = -sp[-1].i;
+    VM_NEXT;
+  VM_OP(SGN):
+    if (sp[-1].i > 1)
+      sp[-1].i = 1;
+    if (sp[-1].i < 0)
+      sp[-1].i = -1;
+    VM_NEXT;
+  VM_OP(LEN):
+    sp[-1].i = *sp[-1].p;
+    VM_NEXT;
+  VM_OP(CODE):
+    sp[-1].i = *sp[-1].p ? sp[-1].p[1] : 0;
+    VM_NEXT;
+  VM_OP(VAL):
+    t.d.p = sp[-1].p;
+    sp[-1].i = string_val(&t);
+    VM_NEXT;
+  VM_OP(LEFTSTR):
+    sp--;
+    t.d.p = sp[-1].p;
+    string_cut(&o, &t, 1, sp->i);
+    sp[-1].p = o.d.p;
+    VM_NEXT;
+  VM_OP(RIGHTSTR):
+    sp--;
+    t.d.p = sp[-1].p;
+    string_cut_r(&o, &t, sp->i);
+    sp[-1].p = o.d.p;
+    VM_NEXT;
+  VM_OP(MIDSTR):
+    sp -= 2;
+    t.d.p = sp[-1].p;
+    string_cut(&o, &t, sp[0].i, sp[1].i);
+    sp[-1].p = o.d.p;
+    VM_NEXT;
+  VM_OP(CHRSTR):
+    o.d.p = string_temp(1);
+    o.d.p[1] = sp[-1].i;
+    sp[-1].p = o.d.p;
+    VM_NEXT;
+#ifndef __GNUC__
+  }
+#endif
+}
+/*---------------------------------------------------------------------------*/
+/* Find or make the code for whatever starts at the current token. Returns
+   NULL with the tokenizer unmoved if it has to be interpreted */
+static struct compiled_expr *compiled(uint8_t (*compiler)(void))
+{
+  char const *site = tokenizer_pos();
+  struct compiled_expr *ce = compiled_find(site);
+
+  if (ce == NULL)
+    return NULL;
+  if (ce->site == NULL) {
+    ctx->cp = ctx->cbuf;
+    ctx->cfail = ctx->cdepth = ctx->cmax = 0;
+    ce->type = compiler();
+    emit(OP_END);
+    ce->end = tokenizer_pos();
+    ce->code = NULL;
+    if (!ctx->cfail && ctx->cmax <= VM_STACK_DEPTH)
+      ce->code = code_save(ctx->cp - ctx->cbuf);
+    ce->site = site;
+    ctx->ctable_used++;
+    if (ce->code == NULL)
+      tokenizer_goto(site);
+  }
+  if (ce->code == NULL)
+    return NULL;
+  return ce;
+}
+/*---------------------------------------------------------------------------*/
+static void expr(struct typevalue *v)
+{
+  struct compiled_expr *ce;
+  struct string_mark m;
+
+  string_temp_mark(&m);
+  if (ctx->compile && (ce = compiled(c_expr)) != NULL) {
+    v->type = ce->type;
+    vm_run(ce->code, v);
+    tokenizer_goto(ce->end);
+    if (ctx->stats)
+      ctx->stats->compiled++;
+  } else {
+    logic_expr(v);
+    if (ctx->stats)
+      ctx->stats->interpreted++;
+  }
+  if (v->type == TYPE_STRING)
+    string_temp_keep(&m, v);
+  else
+    string_temp_release(&m);
+}
+/*---------------------------------------------------------------------------*/
+static value_t intexpr(void)
+{
+  struct typevalue t;
+  expr(&t);
+  typecheck_int(&t);
+  return t.d.i;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *stringexpr(void)
+{
+  struct typevalue t;
+  expr(&t);
+  typecheck_string(&t);
+  return t.d.p;
+}
+/*---------------------------------------------------------------------------*/
+static void index_add(line_t linenum, char const *sourcepos)
+{
+  struct line_index *lidx;
+
+  if (ctx->line_count == ctx->line_index_size) {
+    ctx->line_index_size = ctx->line_index_size ? 2 * ctx->line_index_size : 64;
+    ctx->line_index = realloc(ctx->line_index,
+                         ctx->line_index_size * sizeof(struct line_index));
+    if (ctx->line_index == NULL)
+      ubasic_error(outofmemory);
+  }
+  /* Programs are almost always in order so this rarely moves anything.
+     Equal line numbers stay in program order so the first one wins */
+  lidx = ctx->line_index + ctx->line_count++;
+  while(lidx > ctx->line_index && lidx[-1].line_number > linenum) {
+    *lidx = lidx[-1];
+    lidx--;
+  }
+  lidx->line_number = linenum;
+  lidx->offset = sourcepos - ctx->program_ptr;
+  DEBUG_PRINTF("index_add: Adding index for line %d: %p.\n", linenum,
+               sourcepos);
+}
+/*---------------------------------------------------------------------------*/
+/* Where the line is, or would be, in the index */
+static unsigned int index_slot(int linenum)
+{
+  unsigned int low = 0, high = ctx->line_count, mid;
+
+  while(low < high) {
+    mid = (low + high) / 2;
+    if (ctx->line_index[mid].line_number < (line_t)linenum)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+/*---------------------------------------------------------------------------*/
+static char const *index_find(int linenum)
+{
+  unsigned int i;
+
+  if (ctx->stats)
+    ctx->stats->line_lookups++;
+  i = index_slot(linenum);
+  if (i < ctx->line_count && ctx->line_index[i].line_number == (line_t)linenum) {
+    DEBUG_PRINTF("index_find: Returning index for line %d.\n", linenum);
+    return ctx->program_ptr + ctx->line_index[i].offset;
+  }
+  DEBUG_PRINTF("index_find: Returning NULL.\n");
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void index_build(void)
+{
+  char const *pos;
+
+  ctx->line_count = 0;
+  while(!tokenizer_finished()) {
+    /* Anything else will be a syntax error if it is ever run */
+    if (current_token == TOKENIZER_NUMBER)
+      index_add(tokenizer_num(), tokenizer_pos());
+    tokenizer_newline();
+    tokenizer_next();
+  }
+  tokenizer_goto(ctx->program_ptr);
+  /* Point the constant jumps in a crunched program at their lines */
+  if (ctx->crunched) {
+    while(!tokenizer_finished()) {
+      if (current_token == TOKENIZER_LINEREF &&
+          (pos = index_find(tokenizer_num())) != NULL)
+        tokenizer_set_lineref(pos);
+      tokenizer_next();
+    }
+    tokenizer_goto(ctx->program_ptr);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void data_add(uint8_t type, uint32_t v)
+{
+  struct data_item *d;
+
+  if (ctx->data_count == ctx->data_size) {
+    ctx->data_size = ctx->data_size ? 2 * ctx->data_size : 64;
+    d = realloc(ctx->data, ctx->data_size * sizeof(struct data_item));
+    if (d == NULL)
+      ubasic_error(outofmemory);
+    ctx->data = d;
+  }
+  d = ctx->data + ctx->data_count++;
+  d->type = type;
+  d->v = v;
+}
+/*---------------------------------------------------------------------------*/
+static void data_string(void)
+{
+  unsigned int len = tokenizer_string_len();
+  uint8_t *p;
+
+  /* Too long to READ, so leave a bad item in its place */
+  if (len > 255) {
+    data_add(0, 0);
+    return;
+  }
+  if (ctx->data_pool_len + len + 1 > ctx->data_pool_size) {
+    ctx->data_pool_size = 2 * ctx->data_pool_size + len + 256;
+    p = realloc(ctx->data_pool, ctx->data_pool_size);
+    if (p == NULL)
+      ubasic_error(outofmemory);
+    ctx->data_pool = p;
+  }
+  p = ctx->data_pool + ctx->data_pool_len;
+  *p = len;
+  memcpy(p + 1, tokenizer_string(), len);
+  data_add(TYPE_STRING, ctx->data_pool_len);
+  ctx->data_pool_len += len + 1;
+}
+/*---------------------------------------------------------------------------*/
+/* The items of one DATA statement, which runs to the end of the line */
+static void data_items(void)
+{
+  for (;;) {
+    if (current_token == TOKENIZER_NUMBER)
+      data_add(TYPE_INTEGER, (uint32_t)tokenizer_num());
+    else if (current_token == TOKENIZER_STRING)
+      data_string();
+    else
+      break;
+    tokenizer_next();
+    if (current_token == TOKENIZER_NL || tokenizer_finished())
+      return;
+    if (current_token != TOKENIZER_COMMA)
+      break;
+    tokenizer_next();
+  }
+  /* READ reports it if it gets this far */
+  data_add(0, 0);
+  tokenizer_newline();
+}
+/*---------------------------------------------------------------------------*/
+/* Decode every DATA item in program order, noting for each line in the
+   index where its items begin so that RESTORE is a lookup. Bad lines must
+   not fail the load: the rest of the line is skipped, or a bad item left
+   for READ to report */
+static void data_build(void)
+{
+  unsigned int slot, first;
+  char const *line;
+
+  while(!tokenizer_finished()) {
+    line = tokenizer_pos();
+    first = ctx->data_count;
+    slot = ctx->line_count;
+    if (current_token == TOKENIZER_NUMBER) {
+      slot = index_slot(tokenizer_num());
+      if (slot < ctx->line_count &&
+          ctx->program_ptr + ctx->line_index[slot].offset != line)
+        slot = ctx->line_count;
+    }
+    while(current_token != TOKENIZER_NL && !tokenizer_finished()) {
+      if (current_token == TOKENIZER_DATA) {
+        tokenizer_next();
+        data_items();
+        break;
+      }
+      if (current_token == TOKENIZER_REM || current_token == TOKENIZER_ERROR) {
+        tokenizer_newline();
+        break;
+      }
+      tokenizer_next();
+    }
+    /* Lines before the first DATA all start at item 0 */
+    if (ctx->data_count && ctx->data_start == NULL) {
+      ctx->data_start = calloc(ctx->line_count, sizeof(uint32_t));
+      if (ctx->data_start == NULL && ctx->line_count)
+        ubasic_error(outofmemory);
+    }
+    if (ctx->data_start && slot < ctx->line_count)
+      ctx->data_start[slot] = first;
+    tokenizer_next();
+  }
+  tokenizer_goto(ctx->program_ptr);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ *	A program image is this header, the line index, the DATA table and
+ *	the crunched program with its jumps resolved, then the DATA strings.
+ *	It is in the byte order and layout of the machine that wrote it so
+ *	it can be run wherever it is mapped; anything else fails the version
+ *	or size checks.
+ */
+struct image_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t index_size;
+  uint16_t item_size;
+  uint16_t unused;
+  uint32_t lines;
+  uint32_t length;		/* Of the crunched program */
+  uint32_t items;		/* DATA, with a start for each line if any */
+  uint32_t pool;
+};
+
+#define IMAGE_VERSION	3
+
+static uint8_t *image_put(uint8_t *p, const void *data, unsigned long len)
+{
+  if (len)
+    memcpy(p, data, len);
+  return p + len;
+}
+
+void *ubasic_image(struct ubasic_ctx *c, unsigned long *len)
+{
+  struct image_header h;
+  unsigned long index_len, start_len, data_len;
+  uint8_t *image, *p;
+
+  select_ctx(c);
+  if (ctx->crunched == NULL || ctx->error)
+    return NULL;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, UBASIC_IMAGE_MAGIC, 4);
+  h.version = IMAGE_VERSION;
+  h.index_size = sizeof(struct line_index);
+  h.item_size = sizeof(struct data_item);
+  h.lines = ctx->line_count;
+  h.length = ctx->crunched_len;
+  h.items = ctx->data_count;
+  h.pool = ctx->data_pool_len;
+  index_len = ctx->line_count * sizeof(struct line_index);
+  start_len = ctx->data_count ? ctx->line_count * sizeof(uint32_t) : 0;
+  data_len = ctx->data_count * sizeof(struct data_item);
+  *len = sizeof(h) + index_len + start_len + data_len + h.length + h.pool;
+  image = malloc(*len);
+  if (image == NULL)
+    return NULL;
+  p = image_put(image, &h, sizeof(h));
+  p = image_put(p, ctx->line_index, index_len);
+  p = image_put(p, ctx->data_start, start_len);
+  p = image_put(p, ctx->data, data_len);
+  p = image_put(p, ctx->program_ptr, h.length);
+  image_put(p, ctx->data_pool, h.pool);
+  return image;
+}
+/*---------------------------------------------------------------------------*/
+/* The next n things of size bytes from what is left of the image */
+static const char *image_take(const char **p, unsigned long *left,
+                              unsigned long n, unsigned long size)
+{
+  const char *r = *p;
+
+  if (n > *left / size)
+    ubasic_error(badimage);
+  *p += n * size;
+  *left -= n * size;
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+#define LINE_START(starts, o)	((starts)[(o) / 8] & (1 << ((o) % 8)))
+
+/* The program, the index and every jump in it agree. A variable number
+   beyond the tables would also be trusted when it is run */
+static int image_lines(const char *program, unsigned long length,
+                       uint8_t *starts)
+{
+  unsigned int i;
+  unsigned long o;
+  char const *p;
+  var_t v;
+
+  if (!tokenizer_check_crunched(program, length, starts))
+    return 0;
+  for (i = 0; i < ctx->line_count; i++) {
+    o = ctx->line_index[i].offset;
+    if (o >= length || !LINE_START(starts, o))
+      return 0;
+    if (i && ctx->line_index[i - 1].line_number >
+             ctx->line_index[i].line_number)
+      return 0;
+  }
+  tokenizer_init_crunched(program);
+  while(!tokenizer_finished()) {
+    if (current_token == TOKENIZER_LINEREF &&
+        (p = tokenizer_lineref()) != NULL) {
+      o = p - program;
+      if (o >= length || !LINE_START(starts, o))
+        return 0;
+    }
+    if (current_token == TOKENIZER_INTVAR ||
+        current_token == TOKENIZER_STRINGVAR) {
+      v = tokenizer_variable_num();
+      if (current_token == TOKENIZER_INTVAR ? (v & STRINGFLAG) != 0 :
+          (v & STRINGFLAG) == 0 || (v & ~STRINGFLAG) >= MAX_STRING)
+        return 0;
+    }
+    tokenizer_next();
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Every DATA start is within the table and every string within the pool */
+static int image_data(const struct image_header *h)
+{
+  struct data_item *d;
+  unsigned long i;
+
+  if (ctx->data_start)
+    for (i = 0; i < h->lines; i++)
+      if (ctx->data_start[i] > h->items)
+        return 0;
+  for (i = 0; i < h->items; i++) {
+    d = ctx->data + i;
+    if (d->type == TYPE_STRING) {
+      if (d->v >= h->pool || ctx->data_pool[d->v] >= h->pool - d->v)
+        return 0;
+    } else if (d->type != TYPE_INTEGER && d->type != 0)
+      return 0;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Run an image in place. It must stay put until the context is freed */
+struct ubasic_ctx *ubasic_init_image(const void *image, unsigned long len,
+                                     int flags)
+{
+  jmp_buf catch;
+  const struct image_header *h = image;
+  const char *p = image, *program;
+  struct ubasic_ctx *c = ctx_new(flags);
+  uint8_t *starts;
+  int ok;
+
+  if (c == NULL)
+    return NULL;
+  if (setjmp(catch) == 0) {
+    ctx->catch = &catch;
+    ctx->image = 1;
+    image_take(&p, &len, 1, sizeof(*h));
+    if (memcmp(h->magic, UBASIC_IMAGE_MAGIC, 4) ||
+        h->version != IMAGE_VERSION ||
+        h->index_size != sizeof(struct line_index) ||
+        h->item_size != sizeof(struct data_item) || h->length == 0)
+      ubasic_error(badimage);
+    ctx->line_index = (struct line_index *)
+      image_take(&p, &len, h->lines, sizeof(struct line_index));
+    ctx->line_count = h->lines;
+    if (h->items)
+      ctx->data_start = (uint32_t *)
+        image_take(&p, &len, h->lines, sizeof(uint32_t));
+    ctx->data = (struct data_item *)
+      image_take(&p, &len, h->items, sizeof(struct data_item));
+    ctx->data_count = h->items;
+    program = image_take(&p, &len, h->length, 1);
+    ctx->data_pool = (uint8_t *)image_take(&p, &len, h->pool, 1);
+    /* Nothing in it is trusted until it has been walked */
+    starts = calloc(h->length / 8 + 1, 1);
+    if (starts == NULL)
+      ubasic_error(outofmemory);
+    ok = image_lines(program, h->length, starts) && image_data(h);
+    free(starts);
+    if (!ok)
+      ubasic_error(badimage);
+    tokenizer_init_crunched(program);
+    ctx_start(program, flags);
+  }
+  ctx->catch = NULL;
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+static char const *line_target(int linenum)
+{
+  char const *pos = index_find(linenum);
+  if (pos == NULL)
+    ubasic_error(undefinedline);
+  return pos;
+}
+/*---------------------------------------------------------------------------*/
+/* The target of a GO TO, GO SUB or THEN. A constant line number was
+   resolved to the line itself when the program was crunched */
+static char const *jump_target(void)
+{
+  char const *pos;
+
+  if (current_token == TOKENIZER_LINEREF) {
+    pos = tokenizer_lineref();
+    if (pos == NULL)
+      ubasic_error(undefinedline);
+    accept_tok(TOKENIZER_LINEREF);
+    if (ctx->stats)
+      ctx->stats->linerefs++;
+  } else
+    pos = line_target(intexpr());
+  if (!statement_end())
+    syntax_error();
+  return pos;
+}
+/*---------------------------------------------------------------------------*/
+/* Room for another frame on a FOR or GOSUB stack */
+static void *stack_grow(void *stack, unsigned int *size, unsigned int limit,
+                        size_t frame, const char *err)
+{
+  unsigned int n;
+
+  if (*size >= limit)
+    ubasic_error(err);
+  n = *size ? 2 * *size : 8;
+  if (n > limit)
+    n = limit;
+  stack = realloc(stack, n * frame);
+  if (stack == NULL)
+    ubasic_error(outofmemory);
+  *size = n;
+  return stack;
+}
+/*---------------------------------------------------------------------------*/
+static void go_statement(void)
+{
+  char const *pos;
+  struct gosub_state *gs;
+  uint8_t t;
+
+  t = accept_either(TOKENIZER_TO, TOKENIZER_SUB);
+  pos = jump_target();
+  if (t == TOKENIZER_TO) {
+    DEBUG_PRINTF("go_statement: jumping.\n");
+    tokenizer_goto(pos);
+    return;
+  }
+
+  if (ctx->gosub_stack_ptr == ctx->gosub_stack_size)
+    ctx->gosub_stack = stack_grow(ctx->gosub_stack, &ctx->gosub_stack_size,
+                                  ctx->gosub_limit, sizeof(struct gosub_state),
+                                  toomanygosub);
+  gs = &ctx->gosub_stack[ctx->gosub_stack_ptr++];
+  gs->resume_token = tokenizer_pos();
+  gs->line = ctx->line_num;
+  gs->fors = ctx->for_stack_ptr;
+  if (ctx->gosub_stack_ptr > ctx->gosub_high)
+    ctx->gosub_high = ctx->gosub_stack_ptr;
+  tokenizer_goto(pos);
+}
+/*---------------------------------------------------------------------------*/
+
+/*
+ *	Output is gathered in a buffer and handed to the sink in blocks. It
+ *	is flushed when full, at a newline if line buffered, before input or
+ *	any host screen call, when the program ends and on request.
+ */
+
+
+static void write_sink(struct ubasic_ctx *c, const char *p, unsigned int len)
+{
+  write(1, p, len);
+}
+
+static void output_flush(void)
+{
+  if (ctx->outlen) {
+    ctx->outsink(ctx, ctx->outbuf, ctx->outlen);
+    ctx->outlen = 0;
+  }
+}
+
+static int read_source(struct ubasic_ctx *c, char *p, unsigned int len)
+{
+  return read(0, p, len);
+}
+
+static void output_init(void)
+{
+  ctx->insource = read_source;
+  ctx->outsink = write_sink;
+  ctx->outsize = UBASIC_OUTBUF;
+  /* Like stdio, buffer by line only when someone is watching */
+  ctx->outflags = isatty(1) ? UBASIC_LINEBUF : 0;
+}
+
+void ubasic_set_output(struct ubasic_ctx *c, ubasic_sink_t sink,
+                       unsigned int size, int flags)
+{
+  select_ctx(c);
+  output_flush();
+  ctx->outsink = sink ? sink : write_sink;
+  if (size == 0 || size > UBASIC_OUTBUF)
+    size = UBASIC_OUTBUF;
+  ctx->outsize = size;
+  ctx->outflags = flags;
+}
+
+void ubasic_set_input(struct ubasic_ctx *c, ubasic_source_t source)
+{
+  c->insource = source ? source : read_source;
+}
+
+void ubasic_flush(struct ubasic_ctx *c)
+{
+  select_ctx(c);
+  output_flush();
+}
+
+static void charout(char c, void *unused)
+{
+  if (c == '\t') {
+    do {
+      charout(' ', NULL);
+    } while(ctx->chpos%8);
+    return;
+  }
+#ifdef __ia16__
+  if (c == '\n') {
+    ctx->outbuf[ctx->outlen++] = '\r';
+    if (ctx->outlen >= ctx->outsize)
+      output_flush();
+  }
+#endif
+  ctx->outbuf[ctx->outlen++] = c;
+  if (ctx->outlen >= ctx->outsize || (c == '\n' && (ctx->outflags & UBASIC_LINEBUF)))
+    output_flush();
+  if ((c == 8 || c== 127) && ctx->chpos)
+    ctx->chpos--;
+  else if (c == '\r' || c == '\n')
+    ctx->chpos = 0;
+  else
+    ctx->chpos++;
+}
+
+static void charreset(void)
+{
+  ctx->chpos = 0;
+}
+
+static void chartab(value_t v)
+{
+  if (v < 1)
+    v = 1;
+  if (ctx->chpos >= v)
+    charout('\n', NULL);
+  while(ctx->chpos < v - 1)
+    charout(' ', NULL);
+}
+
+static void charoutstr(uint8_t *p)
+{
+  int len =*p++;
+  while(len--)
+    charout(*p++, NULL);
+}
+
+static void intout(value_t v)
+{
+  char buf[INT_TEXT];
+  char *end = buf + INT_TEXT;
+  char *p = int_text(v, end);
+  unsigned int len = end - p;
+
+  /* Digits need none of the charout() special cases */
+  if (len > ctx->outsize) {
+    while(p < end)
+      charout(*p++, NULL);
+    return;
+  }
+  if (ctx->outlen + len > ctx->outsize)
+    output_flush();
+  memcpy(ctx->outbuf + ctx->outlen, p, len);
+  ctx->outlen += len;
+  ctx->chpos += len;
+  if (ctx->outlen == ctx->outsize)
+    output_flush();
+}
+
+static void print_statement(void)
+{
+  struct string_mark m;
+  uint8_t nonl;
+  uint8_t t;
+  uint8_t nv = 0;
+
+  do {
+    t = current_token;
+    nonl = 0;
+    DEBUG_PRINTF("Print loop\n");
+    if (nv == 0) {
+      if(t == TOKENIZER_STRING) {
+        /* Handle string const specially - length rules */
+        tokenizer_string_func(charout, NULL);
+        tokenizer_next();
         nv = 1;
         continue;
       } else if(TOKENIZER_STRINGEXP(t)) {
+        string_temp_mark(&m);
         charoutstr(stringexpr());
+        string_temp_release(&m);
         nv = 1;
         continue;
       } else if(TOKENIZER_NUMEXP(t)) {
@@ -892,8 +2380,9 @@ static void print_statement(void)
         y = intexpr();
         accept_tok(TOKENIZER_COMMA);
         x = intexpr();
+        output_flush();
         if (move_cursor(x,y))
-          chpos = x;
+          ctx->chpos = x;
         continue;
       }
     }
@@ -924,21 +2413,20 @@ static int if_statement(void)
   DEBUG_PRINTF("if_statement: relation %d\n", r.d.i);
   accept_tok(TOKENIZER_THEN);
   if(r.d.i) {
-    if (current_token != TOKENIZER_NUMBER) {
-      statementgroup();
+    if (current_token != TOKENIZER_NUMBER &&
+        current_token != TOKENIZER_LINEREF) {
+      /* Carry on with the statement after THEN */
+      return 2;
     } else {
       /* THEN number:  Allow an arbitrary expression as a line number to
          GO TO.  Well, almost arbitrary --- require the expression to start
          with a numeric token, otherwise the grammar becomes ambiguous.
            -- tkchia 20180616  */
-      int linenum = intexpr();
-      if (!statement_end())
-        syntax_error();
-      jump_linenum(linenum);
+      tokenizer_goto(jump_target());
       return 0;
     }
   } else {
-    tokenizer_newline();
+    tokenizer_skip_line();
   }
   return 1;
 }
@@ -948,8 +2436,16 @@ static void let_statement(void)
   var_t var;
   struct typevalue v;
   struct typevalue s[MAX_SUBSCRIPT];
+  struct compiled_expr *ce;
   int n = 0;
 
+  if (ctx->compile && (ce = compiled(c_let)) != NULL) {
+    vm_run(ce->code, NULL);
+    tokenizer_goto(ce->end);
+    if (ctx->stats)
+      ctx->stats->compiled++;
+    return;
+  }
   var = tokenizer_variable_num();
   accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
   if (current_token == TOKENIZER_LEFTPAREN)
@@ -958,45 +2454,62 @@ static void let_statement(void)
   accept_tok(TOKENIZER_EQ);
   expr(&v);
   DEBUG_PRINTF("let_statement: assign %d to %d\n", var, v.d.i);
-  ubasic_set_variable(var, &v, n, s);
+  set_variable(var, &v, n, s);
 }
 /*---------------------------------------------------------------------------*/
 static void return_statement(void)
 {
-  if(gosub_stack_ptr > 0) {
-    gosub_stack_ptr--;
-    tokenizer_goto(gosub_stack[gosub_stack_ptr]);
-  } else {
-    DEBUG_PRINTF("return_statement: non-matching return\n");
+  struct gosub_state *gs;
+
+  if (ctx->gosub_stack_ptr == 0)
+    ubasic_error("Return without gosub");
+  gs = &ctx->gosub_stack[--ctx->gosub_stack_ptr];
+  tokenizer_goto(gs->resume_token);
+  ctx->line_num = gs->line;
+  /* Loops left open in the subroutine are finished with */
+  if (ctx->for_stack_ptr > gs->fors)
+    ctx->for_stack_ptr = gs->fors;
+}
+/*---------------------------------------------------------------------------*/
+/* The innermost open loop on var, dropping any inside it that were left
+   with a GOTO. NULL if there isn't one. Loops outside the current GOSUB
+   belong to the caller and are not looked at */
+static struct for_state *for_find(var_t var)
+{
+  unsigned int i = ctx->for_stack_ptr;
+  unsigned int base = 0;
+
+  if (ctx->gosub_stack_ptr)
+    base = ctx->gosub_stack[ctx->gosub_stack_ptr - 1].fors;
+  while(i > base) {
+    if (ctx->for_stack[--i].for_variable == var) {
+      ctx->for_stack_ptr = i + 1;
+      return &ctx->for_stack[i];
+    }
   }
+  return NULL;
 }
 /*---------------------------------------------------------------------------*/
 static void next_statement(void)
 {
   int var;
   struct for_state *fs;
-  struct typevalue t;
+  value_t v;
 
-  /* FIXME: support 'NEXT' on its own, also loop down the stack so if you
-     GOTO out of a layer of NEXT the right thing occurs */
+  /* FIXME: support 'NEXT' on its own */
   var = tokenizer_variable_num();
   accept_tok(TOKENIZER_INTVAR);
-  
-  /* FIXME: make the for stack just use pointers so it compiles better */
-  fs = &for_stack[for_stack_ptr - 1];
-  if(for_stack_ptr > 0 &&
-     var == fs->for_variable) {
-    ubasic_get_variable(var, &t, 0, NULL);
-    t.d.i += fs->step;
-    ubasic_set_variable(var, &t, 0,NULL);
-    /* NEXT end depends upon sign of STEP */
-    if ((fs->step >= 0 && t.d.i <= fs->to) ||
-        (fs->step < 0 && t.d.i >= fs->to))
-      tokenizer_goto(fs->resume_token);
-    else
-      for_stack_ptr--;
-  } else
+
+  fs = for_find(var);
+  if (fs == NULL)
     ubasic_error("Mismatched NEXT");
+  /* FOR checked the variable so it can be worked on directly */
+  v = *fs->var += fs->step;
+  if (fs->down ? v >= fs->to : v <= fs->to) {
+    tokenizer_goto(fs->resume_token);
+    ctx->line_num = fs->line;
+  } else
+    ctx->for_stack_ptr--;
 }
 /*---------------------------------------------------------------------------*/
 static void for_statement(void)
@@ -1004,6 +2517,7 @@ static void for_statement(void)
   var_t for_variable;
   value_t to, step = 1;
   struct typevalue t;
+  struct for_state *fs;
 
   for_variable = tokenizer_variable_num();
   accept_tok(TOKENIZER_INTVAR);
@@ -1011,7 +2525,7 @@ static void for_statement(void)
   expr(&t);
   typecheck_int(&t);
   /* The set also typechecks the variable */
-  ubasic_set_variable(for_variable, &t, 0, NULL);
+  set_variable(for_variable, &t, 0, NULL);
   accept_tok(TOKENIZER_TO);
   to = intexpr();
   if (current_token == TOKENIZER_STEP) {
@@ -1020,23 +2534,31 @@ static void for_statement(void)
   }
   if (!statement_end())
     syntax_error();
+  /* Starting a loop on a variable again, perhaps after leaving it with a
+     GOTO, replaces it and anything opened inside it */
+  if (for_find(for_variable) != NULL)
+    ctx->for_stack_ptr--;
+  else if (ctx->for_stack_ptr == ctx->for_stack_size)
+    ctx->for_stack = stack_grow(ctx->for_stack, &ctx->for_stack_size,
+                                ctx->for_limit, sizeof(struct for_state),
+                                toomanyfor);
   /* Save a pointer to the : or CR, when we return to statements it
      will do the right thing */
-  if(for_stack_ptr < MAX_FOR_STACK_DEPTH) {
-    struct for_state *fs = &for_stack[for_stack_ptr];
-    fs->resume_token = tokenizer_pos();
-    fs->for_variable = for_variable;
-    fs->to = to;
-    fs->step = step;
-    DEBUG_PRINTF("for_statement: new for, var %d to %d step %d\n",
-                fs->for_variable,
-                fs->to,
-                fs->step);
-
-    for_stack_ptr++;
-  } else {
-    DEBUG_PRINTF("for_statement: for stack depth exceeded\n");
-  }
+  fs = &ctx->for_stack[ctx->for_stack_ptr++];
+  fs->resume_token = tokenizer_pos();
+  fs->var = find_variable(for_variable, &t, 0, NULL);
+  fs->line = ctx->line_num;
+  fs->for_variable = for_variable;
+  fs->to = to;
+  fs->step = step;
+  /* NEXT end depends upon sign of STEP */
+  fs->down = step < 0;
+  DEBUG_PRINTF("for_statement: new for, var %d to %d step %d\n",
+               fs->for_variable,
+               fs->to,
+               fs->step);
+  if (ctx->for_stack_ptr > ctx->for_high)
+    ctx->for_high = ctx->for_stack_ptr;
 }
 /*---------------------------------------------------------------------------*/
 static void poke_statement(void)
@@ -1053,32 +2575,19 @@ static void poke_statement(void)
 /*---------------------------------------------------------------------------*/
 static void stop_statement(void)
 {
-  ended = 1;
+  ctx->ended = 1;
 }
 /*---------------------------------------------------------------------------*/
-static void rem_statement(void)
-{
-  tokenizer_newline();
-}
-
-/*---------------------------------------------------------------------------*/
-static void data_statement(void)
-{
-  uint8_t t;
-  do {
-    t = current_token;
-    /* We could just as easily allow expressions which might be wild... */
-    /* Some platforms allow 4,,5  ... we don't yet FIXME */
-    if (t == TOKENIZER_STRING || t == TOKENIZER_NUMBER)
-      tokenizer_next();
-    else
-      syntax_error();
-    t = current_token;
-    if (t == TOKENIZER_COMMA)
-      accept_tok(t);
-    else if (!statement_end())
-      syntax_error();
-  } while(t != TOKENIZER_NL);
+static void rem_statement(void)
+{
+  tokenizer_skip_line();
+}
+
+/*---------------------------------------------------------------------------*/
+/* Only READ looks inside */
+static void data_statement(void)
+{
+  tokenizer_skip_line();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1110,7 +2619,7 @@ static void option_statement(void)
   r = intexpr();
   if (r < 0 || r > 1)
     ubasic_error("Invalid base");
-  array_base = r;
+  ctx->array_base = r;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1135,6 +2644,7 @@ static void input_statement(void)
     charout(' ', NULL);
   }
 
+  output_flush();
   begin_input();
   /* Consider the single var allowed version of INPUT - it's saner for
      strings by far ? */
@@ -1151,10 +2661,8 @@ static void input_statement(void)
       n = parse_subscripts(s);
 
     /* FIXME: this works for stdin but not files .. */
-    if ((l = read(0, buf + 1, 128)) <= 0) {
-      write(2, "EOF\n", 4);
-      exit(1);
-    }
+    if ((l = ctx->insource(ctx, buf + 1, 128)) <= 0)
+      ubasic_error("EOF");
     charreset();		/* Newline input so move to left */
     if (t == TOKENIZER_INTVAR) {
       r.type = TYPE_INTEGER;	/* For now */
@@ -1167,7 +2675,7 @@ static void input_statement(void)
       *((uint8_t *)buf) = l;
       r.d.p = (uint8_t *)buf;
     }
-    ubasic_set_variable(v, &r, n, s);
+    set_variable(v, &r, n, s);
   } while(!statement_end());
   end_input();
 }
@@ -1176,16 +2684,57 @@ static void input_statement(void)
 void restore_statement(void)
 {
   int linenum = 0;
+  unsigned int i;
+
   if (!statement_end())
     linenum = intexpr();
+  ctx->data_next = 0;
   if (linenum) {
-    tokenizer_push();
-    jump_linenum(linenum);
-    data_position = tokenizer_pos();
-    tokenizer_pop();
-  } else
-    data_position = program_ptr;
-  data_seek = 1;
+    i = index_slot(linenum);
+    if (i == ctx->line_count ||
+        ctx->line_index[i].line_number != (line_t)linenum)
+      ubasic_error(undefinedline);
+    if (ctx->data_start)
+      ctx->data_next = ctx->data_start[i];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void data_read(struct typevalue *r)
+{
+  struct data_item *d;
+
+  if (ctx->data_next == ctx->data_count)
+    ubasic_error(outofdata);
+  d = ctx->data + ctx->data_next++;
+  if (d->type == 0)
+    syntax_error();
+  r->type = d->type;
+  if (d->type == TYPE_STRING)
+    r->d.p = ctx->data_pool + d->v;
+  else
+    r->d.i = (value_t)d->v;
+}
+/*---------------------------------------------------------------------------*/
+static void read_statement(void)
+{
+  struct typevalue r;
+  struct typevalue s[MAX_SUBSCRIPT];
+  var_t v;
+  int n;
+
+  for (;;) {
+    n = 0;
+    v = tokenizer_variable_num();
+    accept_either(TOKENIZER_INTVAR, TOKENIZER_STRINGVAR);
+    if (current_token == TOKENIZER_LEFTPAREN)
+      n = parse_subscripts(s);
+    data_read(&r);
+    set_variable(v, &r, n, s);
+    if (statement_end())
+      break;
+    accept_tok(TOKENIZER_COMMA);
+  }
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1193,51 +2742,290 @@ void restore_statement(void)
 void cls_statement(void)
 {
   charreset();
+  output_flush();
   clear_display();
 }
 
+/*---------------------------------------------------------------------------*/
+/*
+ *	MAT works on whole numeric arrays. The kernels are plain loops over
+ *	the packed elements, kept simple enough for the compiler to
+ *	vectorize when optimizing. Arithmetic wraps as it does elsewhere.
+ *	A vector is a matrix of one column.
+ */
+static void mat_fill(value_t *a, value_t v, unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    a[i] = v;
+}
+
+static void mat_add(value_t *a, const value_t *b, const value_t *c,
+                    unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    a[i] = b[i] + c[i];
+}
+
+static void mat_sub(value_t *a, const value_t *b, const value_t *c,
+                    unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    a[i] = b[i] - c[i];
+}
+
+static void mat_scale(value_t *a, const value_t *b, value_t k,
+                      unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    a[i] = b[i] * k;
+}
+
+/* a (m by n) = b (m by l) * c (l by n), a row of c at a time so the inner
+   loop runs along contiguous rows. a must not be b or c */
+static void mat_mul(value_t *a, const value_t *b, const value_t *c,
+                    unsigned int m, unsigned int l, unsigned int n)
+{
+  unsigned int i, j, k;
+  value_t *row;
+  value_t s;
+
+  for (i = 0; i < m; i++) {
+    row = a + i * n;
+    mat_fill(row, 0, n);
+    for (k = 0; k < l; k++) {
+      s = b[i * l + k];
+      for (j = 0; j < n; j++)
+        row[j] += s * c[k * n + j];
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static unsigned int mat_cols(struct array *a)
+{
+  return a->nsubs == 2 ? a->extent[1] : 1;
+}
+/*---------------------------------------------------------------------------*/
+static void mat_same(struct array *a, struct array *b)
+{
+  if (a->extent[0] != b->extent[0] || mat_cols(a) != mat_cols(b))
+    ubasic_error(mismatch);
+}
+/*---------------------------------------------------------------------------*/
+static struct array *mat_array(void)
+{
+  var_t v = tokenizer_variable_num();
+
+  accept_tok(TOKENIZER_INTVAR);
+  if (v >= MAX_ARRAY || ctx->arrays[v] == NULL)
+    ubasic_error(badsubscript);
+  return ctx->arrays[v];
+}
+/*---------------------------------------------------------------------------*/
+static void mat_multiply(struct array *a, struct array *b, struct array *c)
+{
+  unsigned int m = b->extent[0], l = mat_cols(b), n = mat_cols(c);
+  value_t *p = a->e.i;
+
+  if (c->extent[0] != l || a->extent[0] != m || mat_cols(a) != n)
+    ubasic_error(mismatch);
+  /* Work somewhere else if the result is also an operand */
+  if (a == b || a == c) {
+    p = malloc(a->count * sizeof(value_t));
+    if (p == NULL)
+      ubasic_error(outofmemory);
+  }
+  mat_mul(p, b->e.i, c->e.i, m, l, n);
+  if (p != a->e.i) {
+    memcpy(a->e.i, p, a->count * sizeof(value_t));
+    free(p);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Row by row, in print zones or packed after a ; A vector goes on one line */
+static void mat_print(void)
+{
+  struct array *a;
+  unsigned int i, j, cols;
+  uint8_t packed;
+
+  do {
+    a = mat_array();
+    packed = current_token == TOKENIZER_SEMICOLON;
+    if (!statement_end())
+      accept_either(TOKENIZER_COMMA, TOKENIZER_SEMICOLON);
+    cols = a->nsubs == 2 ? a->extent[1] : a->count;
+    for (i = 0; i < a->count; i += cols) {
+      for (j = 0; j < cols; j++) {
+        if (j)
+          charout(packed ? ' ' : '\t', NULL);
+        intout(a->e.i[i + j]);
+      }
+      charout('\n', NULL);
+    }
+    if (a->nsubs == 2)
+      charout('\n', NULL);
+  } while(!statement_end());
+}
+/*---------------------------------------------------------------------------*/
+static void mat_statement(void)
+{
+  struct array *a, *b, *c;
+  struct typevalue r;
+  unsigned int i;
+  value_t k;
+  uint8_t t;
+
+  t = current_token;
+  if (t == TOKENIZER_PRINT) {
+    accept_tok(t);
+    mat_print();
+    return;
+  }
+  if (t == TOKENIZER_READ) {
+    accept_tok(t);
+    for (;;) {
+      a = mat_array();
+      for (i = 0; i < a->count; i++) {
+        data_read(&r);
+        typecheck_int(&r);
+        a->e.i[i] = r.d.i;
+      }
+      if (statement_end())
+        break;
+      accept_tok(TOKENIZER_COMMA);
+    }
+    return;
+  }
+
+  a = mat_array();
+  accept_tok(TOKENIZER_EQ);
+  t = current_token;
+  switch(t) {
+  case TOKENIZER_ZER:
+  case TOKENIZER_CON:
+    accept_tok(t);
+    mat_fill(a->e.i, t == TOKENIZER_CON, a->count);
+    return;
+  case TOKENIZER_IDN:
+    accept_tok(t);
+    if (a->nsubs != 2 || a->extent[0] != a->extent[1])
+      ubasic_error(mismatch);
+    mat_fill(a->e.i, 0, a->count);
+    for (i = 0; i < a->count; i += a->extent[0] + 1)
+      a->e.i[i] = 1;
+    return;
+  case TOKENIZER_LEFTPAREN:
+    /* MAT A = (K) * B */
+    k = bracketed_intexpr();
+    accept_tok(TOKENIZER_ASTR);
+    b = mat_array();
+    mat_same(a, b);
+    mat_scale(a->e.i, b->e.i, k, a->count);
+    return;
+  }
+  b = mat_array();
+  t = current_token;
+  if (t != TOKENIZER_PLUS && t != TOKENIZER_MINUS && t != TOKENIZER_ASTR) {
+    mat_same(a, b);
+    memmove(a->e.i, b->e.i, a->count * sizeof(value_t));
+    return;
+  }
+  accept_tok(t);
+  c = mat_array();
+  if (t == TOKENIZER_ASTR) {
+    mat_multiply(a, b, c);
+    return;
+  }
+  mat_same(a, b);
+  mat_same(a, c);
+  if (t == TOKENIZER_PLUS)
+    mat_add(a->e.i, b->e.i, c->e.i, a->count);
+  else
+    mat_sub(a->e.i, b->e.i, c->e.i, a->count);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ *	Make an array whose subscripts run from the current OPTION BASE to
+ *	the tops given. Strides are fixed here so finding an element is a
+ *	multiply and add per subscript.
+ */
+static struct array *array_new(int nsubs, value_t *top, unsigned int size)
+{
+  struct array *a;
+  unsigned long count = 1;
+  unsigned int i;
+
+  for (i = 0; i < (unsigned int)nsubs; i++) {
+    if (top[i] < (value_t)ctx->array_base)
+      ubasic_error(badsubscript);
+    count *= top[i] - ctx->array_base + 1;
+  }
+  if (count > (~(size_t)0 - sizeof(struct array)) / size)
+    ubasic_error(outofmemory);
+  a = calloc(1, sizeof(struct array) + count * size);
+  if (a == NULL)
+    ubasic_error(outofmemory);
+  a->nsubs = nsubs;
+  a->size = size;
+  a->base = ctx->array_base;
+  a->count = count;
+  a->e.p = (uint8_t **)(a + 1);
+  i = nsubs;
+  count = 1;
+  while(i-- > 0) {
+    a->extent[i] = top[i] - a->base + 1;
+    a->stride[i] = count;
+    count *= a->extent[i];
+  }
+  return a;
+}
 /*---------------------------------------------------------------------------*/
 void dim_statement(void)
 {
   var_t v = tokenizer_variable_num();
-  value_t s1,s2 = 1;
+  value_t top[MAX_SUBSCRIPT];
+  struct array *a;
+  unsigned int i;
   int n = 1;
-  
+
   accept_either(TOKENIZER_STRINGVAR, TOKENIZER_INTVAR);
-  
+
   /* For now A-Z/A-Z$ only */
   if ((v & ~STRINGFLAG) > 25)
     ubasic_error("invalid array name");
-  
+
   accept_tok(TOKENIZER_LEFTPAREN);
-  s1 = intexpr();
+  top[0] = intexpr();
   if (accept_either(TOKENIZER_RIGHTPAREN, TOKENIZER_COMMA) == TOKENIZER_COMMA) {
-    s2 = intexpr();
+    top[1] = intexpr();
     n = 2;
     accept_tok(TOKENIZER_RIGHTPAREN);
   }
 
   if (v & STRINGFLAG) {
-    uint8_t **p;
     v &= ~STRINGFLAG;
-    if (stringsubs[v] || strings[v] != nullstr)
+    if (ctx->strarrays[v])
       ubasic_error(redimension);
-    stringsubs[v] = n;
-    stringdim[v][0] = s1;
-    stringdim[v][1] = s2;
-    p = calloc(s1 * s2, sizeof(uint8_t *));
-    strings[v] = (uint8_t *)p;
-    for (n = 0; n < s1 * s2; n++)
-      *p++ = nullstr;
+    a = array_new(n, top, sizeof(uint8_t *));
+    for (i = 0; i < a->count; i++)
+      a->e.p[i] = nullstr;
+    ctx->strarrays[v] = a;
   } else {
-    if (variablesubs[v])
+    if (ctx->arrays[v])
       ubasic_error(redimension);
-    variablesubs[v] = n;
-    vardim[v][0] = s1;
-    vardim[v][1] = s2;
-    vararrays[v] = calloc(s1 * s2, sizeof(uint8_t *));
+    ctx->arrays[v] = array_new(n, top, sizeof(value_t));
   }
-}	
+  /* Compiled code assumes the name is still a plain variable */
+  compile_free();
+}
 /*---------------------------------------------------------------------------*/
 static uint8_t statement(void)
 {
@@ -1246,6 +3034,8 @@ static uint8_t statement(void)
   string_temp_free();
 
   token = current_token;
+  if (ctx->stats)
+    ctx->stats->statements[token]++;
   /* LET may be omitted.. */
   if (token != TOKENIZER_INTVAR && token != TOKENIZER_STRINGVAR)
     accept_tok(token);
@@ -1294,6 +3084,12 @@ static uint8_t statement(void)
   case TOKENIZER_RESTORE:
     restore_statement();
     break;
+  case TOKENIZER_READ:
+    read_statement();
+    break;
+  case TOKENIZER_MAT:
+    mat_statement();
+    break;
   case TOKENIZER_DIM:
     dim_statement();
     break;
@@ -1312,116 +3108,410 @@ static uint8_t statement(void)
   return 1;
 }
 
-static uint8_t statementgroup(void)
+/*
+ *	Run one statement and leave the tokenizer at the start of the next.
+ *	statement() returns 0 if it moved us to the start of a line, 2 if
+ *	another statement follows straight on (IF ... THEN statement) and 1
+ *	if we are at the : or end of line that ends it.
+ */
+static void step(void)
 {
-  uint8_t t;
   uint8_t n;
-  while((n = statement())) {
-    DEBUG_PRINTF("next statement %d\n", current_token);
-    t = current_token;
-    if (t == TOKENIZER_COLON)
+
+  if (!ctx->midline) {
+    ctx->line_num = tokenizer_num();
+    DEBUG_PRINTF("----------- Line number %d ---------\n", ctx->line_num);
+    accept_tok(TOKENIZER_NUMBER);
+  }
+  n = statement();
+  if (n == 1) {
+    if (current_token == TOKENIZER_COLON) {
       accept_tok(TOKENIZER_COLON);
-    else
-      break;
+      n = 2;
+    } else
+      accept_tok(TOKENIZER_NL);
   }
-  return n;
+  ctx->midline = n == 2;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ *	Profiling. Each statement is charged the time since the one before
+ *	finished, so there is one clock read per statement. It has its own
+ *	copy of the run loops so that it costs nothing when it is off.
+ */
+/* Microseconds. Only differences are used, so wrapping doesn't matter */
+static unsigned long profile_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+#else
+  return (unsigned long)clock() * (1000000UL / CLOCKS_PER_SEC);
+#endif
 }
+/*---------------------------------------------------------------------------*/
+static void profile_init(void)
+{
+  unsigned int i;
 
-static void statements(void)
+  /* No memory just means no profile */
+  ctx->profile = calloc(ctx->line_count + 1,
+                        sizeof(struct ubasic_line_profile));
+  if (ctx->profile == NULL)
+    return;
+  for (i = 0; i < ctx->line_count; i++)
+    ctx->profile[i].line = ctx->line_index[i].line_number;
+}
+/*---------------------------------------------------------------------------*/
+static struct ubasic_line_profile *profile_find(line_t line)
 {
-  if (statementgroup())
-    accept_tok(TOKENIZER_NL);
+  unsigned int low = 0, high = ctx->line_count, mid;
+
+  while(low < high) {
+    mid = (low + high) / 2;
+    if (ctx->profile[mid].line < line)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low < ctx->line_count && ctx->profile[low].line == line)
+    return ctx->profile + low;
+  return NULL;
 }
+/*---------------------------------------------------------------------------*/
+static void step_profiled(void)
+{
+  struct ubasic_line_profile *p = ctx->prof_cur;
+  line_t line = ctx->midline ? ctx->line_num : tokenizer_num();
+  unsigned long t;
 
+  if (p == NULL || p->line != line)
+    p = profile_find(line);
+  if (p == NULL) {
+    step();
+    return;
+  }
+  if (!ctx->midline)
+    p->runs++;
+  p->statements++;
+  step();
+  t = profile_clock();
+  p->us += t - ctx->prof_time;
+  ctx->prof_time = t;
+  ctx->prof_cur = p;
+}
 /*---------------------------------------------------------------------------*/
-static void line_statements(void)
+static int profile_compare(const void *a, const void *b)
 {
-  line_num = tokenizer_num();
-  DEBUG_PRINTF("----------- Line number %d ---------\n", line_num);
-  index_add(line_num, tokenizer_pos());
-  accept_tok(TOKENIZER_NUMBER);
-  statements();
-  return;
+  const struct ubasic_line_profile *pa = a, *pb = b;
+
+  if (pa->us != pb->us)
+    return pa->us < pb->us ? 1 : -1;
+  return pa->line - pb->line;
 }
 /*---------------------------------------------------------------------------*/
+unsigned int ubasic_profile(struct ubasic_ctx *c,
+                            struct ubasic_line_profile **lines)
+{
+  unsigned int i, n = 0;
 
+  *lines = NULL;
+  if (c->profile == NULL)
+    return 0;
+  free(c->prof_sorted);
+  c->prof_sorted = malloc((c->line_count + 1) *
+                          sizeof(struct ubasic_line_profile));
+  if (c->prof_sorted == NULL)
+    return 0;
+  for (i = 0; i < c->line_count; i++)
+    if (c->profile[i].statements)
+      c->prof_sorted[n++] = c->profile[i];
+  qsort(c->prof_sorted, n, sizeof(struct ubasic_line_profile),
+        profile_compare);
+  *lines = c->prof_sorted;
+  return n;
+}
 /*---------------------------------------------------------------------------*/
-void ubasic_run(void)
+/* Run to the end of the line, or wherever the line sends us */
+void ubasic_run(struct ubasic_ctx *c)
 {
-  if(tokenizer_finished()) {
+  jmp_buf catch;
+
+  if(ubasic_finished(c)) {
     DEBUG_PRINTF("uBASIC program finished\n");
     return;
   }
 
-  line_statements();
+  if (setjmp(catch) == 0) {
+    ctx->catch = &catch;
+    if (ctx->profile) {
+      ctx->prof_time = profile_clock();
+      do
+        step_profiled();
+      while(ctx->midline && !ctx->ended);
+    } else {
+      do
+        step();
+      while(ctx->midline && !ctx->ended);
+    }
+  }
+  ctx->catch = NULL;
+  if (ubasic_finished(c))
+    output_flush();
+}
+/*---------------------------------------------------------------------------*/
+/* Run at most n statements, so no program can hold on to the caller for
+   long. Returns how many were run */
+unsigned int ubasic_run_steps(struct ubasic_ctx *c, unsigned int n)
+{
+  jmp_buf catch;
+  volatile unsigned int i = 0;
+
+  if(ubasic_finished(c))
+    return 0;
+
+  if (setjmp(catch) == 0) {
+    ctx->catch = &catch;
+    if (ctx->profile) {
+      ctx->prof_time = profile_clock();
+      while(i < n && !ctx->ended && !tokenizer_finished()) {
+        step_profiled();
+        i++;
+      }
+    } else {
+      while(i < n && !ctx->ended && !tokenizer_finished()) {
+        step();
+        i++;
+      }
+    }
+  }
+  ctx->catch = NULL;
+  if (ubasic_finished(c))
+    output_flush();
+  return i;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_finished(struct ubasic_ctx *c)
+{
+  select_ctx(c);
+  return ctx->ended || tokenizer_finished();
+}
+/*---------------------------------------------------------------------------*/
+const char *ubasic_failed(struct ubasic_ctx *c)
+{
+  return c->error;
+}
+/*---------------------------------------------------------------------------*/
+line_t ubasic_line(struct ubasic_ctx *c)
+{
+  return c->line_num;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_set_user(struct ubasic_ctx *c, void *user)
+{
+  c->user = user;
+}
+/*---------------------------------------------------------------------------*/
+void *ubasic_user(struct ubasic_ctx *c)
+{
+  return c->user;
+}
+/*---------------------------------------------------------------------------*/
+/* Returns 0 if the program was not loaded with UBASIC_STATS */
+int ubasic_stats(struct ubasic_ctx *c, struct ubasic_stats *s)
+{
+  if (c->stats == NULL)
+    return 0;
+  *s = *c->stats;
+  s->tokens = c->tok.tokens;
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+const char *ubasic_statement_name(int token)
+{
+  if (token == TOKENIZER_INTVAR || token == TOKENIZER_STRINGVAR)
+    return "let (implied)";
+  if (token == TOKENIZER_QUESTION)
+    return "?";
+  return tokenizer_token_name(token);
 }
 /*---------------------------------------------------------------------------*/
-int ubasic_finished(void)
+/* For the host functions, which are not passed the context */
+struct ubasic_ctx *ubasic_current(void)
 {
-  return ended || tokenizer_finished();
+  return ctx;
 }
 /*---------------------------------------------------------------------------*/
-void *ubasic_find_variable(int varnum, struct typevalue *value,
-                                    int nsubs, struct typevalue *subs)
+static void *find_variable(int varnum, struct typevalue *value,
+                           int nsubs, struct typevalue *subs)
 {
   if (varnum & STRINGFLAG) {
-    uint8_t **ap;
     varnum &= ~STRINGFLAG;
     value->type = TYPE_STRING;
     /* for now A$-Z$ only */
     if (varnum > 25)
       ubasic_error("invalid string");
-    if (stringsubs[varnum] != nsubs)
+    if (nsubs)
+      return array_element(ctx->strarrays[varnum], nsubs, subs);
+    if (ctx->strarrays[varnum])
       ubasic_error(badsubscript);
-    if (nsubs == 0)
-      return &strings[varnum];
-    ap = (uint8_t **)strings[varnum];
-    range_check(subs, stringdim[varnum][0]);
-    if (nsubs == 1)
-      return &ap[subs->d.i];
-    range_check(subs+1, stringdim[varnum][1]);
-    return &ap[subs->d.i * stringdim[varnum][0] + subs[1].d.i];
-  } else if(varnum >= 0 && varnum <= MAX_VARNUM) {
-    value_t *ap;
+    return &ctx->strings[varnum];
+  } else if(varnum >= 0 && varnum < MAX_VARNUM) {
     value->type = TYPE_INTEGER;
-    if ((varnum > 25 && nsubs) || variablesubs[varnum] != nsubs)
+    if (nsubs)
+      return array_element(varnum < MAX_ARRAY ? ctx->arrays[varnum] : NULL,
+                           nsubs, subs);
+    if (varnum < MAX_ARRAY && ctx->arrays[varnum])
       ubasic_error(badsubscript);
-    if (nsubs == 0)
-      return &variables[varnum];
-    ap = (value_t *)vararrays[varnum];
-    range_check(subs, vardim[varnum][0]);
-    if (nsubs == 1)
-      return &ap[subs->d.i];
-    range_check(subs+1, vardim[varnum][1]);
-    return &ap[subs->d.i * vardim[varnum][0] + subs[1].d.i];
+    return &ctx->variables[varnum];
   } else
     ubasic_error("badv");
   exit(1);	/* To shut up gcc */
 }
 
-void ubasic_get_variable(int varnum, struct typevalue *value,
-                                    int nsubs, struct typevalue *subs)
+static void get_variable(int varnum, struct typevalue *value,
+                         int nsubs, struct typevalue *subs)
 {
-  void *v = ubasic_find_variable(varnum, value, nsubs, subs);
+  void *v = find_variable(varnum, value, nsubs, subs);
   if (value->type == TYPE_INTEGER)
     value->d.i = *(value_t *)v;
   else
     value->d.p  = *(uint8_t **)v;
 }
 /*---------------------------------------------------------------------------*/
-/* This helper will change once we try and stamp out malloc but will do for
-   the moment */
+/*
+ *	String heap. String variables live in blocks of 8 to 256 bytes carved
+ *	from larger slabs, with a free list for each size. Strings are never
+ *	resized, only replaced, so the block size follows from the length
+ *	byte and blocks need no header.
+ */
+
+#define STRING_SLAB	2048
+
+struct string_slab {
+  struct string_slab *next;
+};
+
+
+static uint8_t string_class(unsigned int len)
+{
+  uint8_t c = 0;
+  while((8U << c) < len)
+    c++;
+  return c;
+}
+/*---------------------------------------------------------------------------*/
+static void string_block_free(uint8_t *p, uint8_t c)
+{
+  *(uint8_t **)p = ctx->string_free_list[c];
+  ctx->string_free_list[c] = p;
+  ctx->string_stats.free += 8U << c;
+}
+/*---------------------------------------------------------------------------*/
+static uint8_t *string_block(uint8_t c)
+{
+  unsigned int size = 8U << c;
+  struct string_slab *s;
+  uint8_t *p = ctx->string_free_list[c];
+
+  if (p != NULL) {
+    ctx->string_free_list[c] = *(uint8_t **)p;
+    ctx->string_stats.free -= size;
+    return p;
+  }
+  if (ctx->slab_end - ctx->slab_ptr < size) {
+    /* Don't waste the end of the old slab */
+    c = STRING_CLASSES - 1;
+    while(ctx->slab_end - ctx->slab_ptr >= 8) {
+      while((8U << c) > ctx->slab_end - ctx->slab_ptr)
+        c--;
+      string_block_free(ctx->slab_ptr, c);
+      ctx->slab_ptr += 8U << c;
+    }
+    s = malloc(sizeof(struct string_slab) + STRING_SLAB);
+    if (ctx->stats)
+      ctx->stats->string_slabs++;
+    if (s == NULL)
+      ubasic_error(outofmemory);
+    s->next = ctx->string_slabs;
+    ctx->string_slabs = s;
+    ctx->slab_ptr = (uint8_t *)(s + 1);
+    ctx->slab_end = ctx->slab_ptr + STRING_SLAB;
+    ctx->string_stats.heap += STRING_SLAB;
+  }
+  p = ctx->slab_ptr;
+  ctx->slab_ptr += size;
+  return p;
+}
+/*---------------------------------------------------------------------------*/
 static uint8_t *string_save(uint8_t *p)
 {
-  uint8_t *b = malloc(*p + 1);
-  if (b == NULL)
-    ubasic_error(outofmemory);
+  uint8_t c;
+  uint8_t *b;
+
+  if (*p == 0)
+    return nullstr;
+  c = string_class(*p + 1);
+  b = string_block(c);
   memcpy(b, p, *p + 1);
+  if (ctx->stats)
+    ctx->stats->string_allocs++;
+  ctx->string_stats.allocs++;
+  ctx->string_stats.used += 8U << c;
+  ctx->string_stats.live += *p + 1;
   return b;
 }
+/*---------------------------------------------------------------------------*/
+static void string_free(uint8_t *p)
+{
+  uint8_t c;
+
+  if (p == nullstr)
+    return;
+  c = string_class(*p + 1);
+  ctx->string_stats.used -= 8U << c;
+  ctx->string_stats.live -= *p + 1;
+  string_block_free(p, c);
+}
+/*---------------------------------------------------------------------------*/
+/* Store a string in a variable, reusing its block if the size fits */
+static void string_assign(uint8_t **s, uint8_t *p)
+{
+  uint8_t *old = *s;
+
+  if (old != nullstr && *p &&
+      string_class(*old + 1) == string_class(*p + 1)) {
+    ctx->string_stats.live += *p - *old;
+    /* The value may be the variable itself */
+    memmove(old, p, *p + 1);
+    return;
+  }
+  *s = string_save(p);
+  string_free(old);
+}
+/*---------------------------------------------------------------------------*/
+/* Nothing is left pointing into the heap so throw it all away */
+static void string_heap_reset(void)
+{
+  struct string_slab *s;
 
-void ubasic_set_variable(int varnum, struct typevalue *value,
-                          int nsubs, struct typevalue *subs)
+  while((s = ctx->string_slabs) != NULL) {
+    ctx->string_slabs = s->next;
+    free(s);
+  }
+  ctx->slab_ptr = ctx->slab_end = NULL;
+  memset(ctx->string_free_list, 0, sizeof(ctx->string_free_list));
+  memset(&ctx->string_stats, 0, sizeof(ctx->string_stats));
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_string_stats(struct ubasic_ctx *c, struct ubasic_string_stats *s)
+{
+  *s = c->string_stats;
+}
+/*---------------------------------------------------------------------------*/
+static void set_variable(int varnum, struct typevalue *value,
+                         int nsubs, struct typevalue *subs)
 {
   void *p;
   if (varnum & STRINGFLAG)
@@ -1429,15 +3519,28 @@ void ubasic_set_variable(int varnum, struct typevalue *value,
   else
     typecheck_int(value);
 
-  p = ubasic_find_variable(varnum, value, nsubs, subs);
+  p = find_variable(varnum, value, nsubs, subs);
   
   if (varnum & STRINGFLAG) {
-    uint8_t **s = p;
-    if (*s != nullstr)
-      free(*s);
-    *s = string_save(value->d.p);
+    string_assign(p, value->d.p);
   } else {
     *(value_t *)p = value->d.i;
   }
 }
 /*---------------------------------------------------------------------------*/
+void ubasic_get_variable(struct ubasic_ctx *c, int varnum,
+                         struct typevalue *value,
+                         int nsubs, struct typevalue *subs)
+{
+  select_ctx(c);
+  get_variable(varnum, value, nsubs, subs);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_set_variable(struct ubasic_ctx *c, int varnum,
+                         struct typevalue *value,
+                         int nsubs, struct typevalue *subs)
+{
+  select_ctx(c);
+  set_variable(varnum, value, nsubs, subs);
+}
+/*---------------------------------------------------------------------------*/
@@ -51,15 +51,134 @@ struct typevalue {
 };
 
 
-void ubasic_init(const char *program);
-void ubasic_run(void);
+/* Interpreter state is per thread where the compiler allows */
+#if defined(__GNUC__) && !defined(__ia16__)
+#define UBASIC_TLS	__thread
+#else
+#define UBASIC_TLS
+#endif
+
+#define UBASIC_CRUNCH	1	/* Pretokenize the program before running it */
+#define UBASIC_COMPILE	2	/* Compile expressions for the stack machine */
+#define UBASIC_QUIET	4	/* Leave reporting errors to the host */
+#define UBASIC_PROFILE	8	/* Count and time the statements on each line */
+#define UBASIC_STATS	16	/* Count what the interpreter does */
+
+/* One loaded program and all of its state. Any number may exist, and each
+   may be used by one thread at a time. The program text must stay put
+   while it runs. NULL is returned only if there is no memory; a program
+   that fails to load comes back already finished and failed */
+struct ubasic_ctx;
+
+struct ubasic_ctx *ubasic_init(const char *program);
+struct ubasic_ctx *ubasic_init_flags(const char *program, int flags);
+void ubasic_free(struct ubasic_ctx *c);
+
+/* A crunched program and its line index saved to run without loading.
+   ubasic_image() wants a UBASIC_CRUNCH program that loaded and returns
+   malloc()ed memory. An image is only good on the machine type and
+   version that made it, and must stay put while it runs */
+#define UBASIC_IMAGE_MAGIC	"\177UBI"
+
+void *ubasic_image(struct ubasic_ctx *c, unsigned long *len);
+struct ubasic_ctx *ubasic_init_image(const void *image, unsigned long len,
+                                     int flags);
+
+void ubasic_run(struct ubasic_ctx *c);
+unsigned int ubasic_run_steps(struct ubasic_ctx *c, unsigned int n);
+int ubasic_finished(struct ubasic_ctx *c);
+const char *ubasic_failed(struct ubasic_ctx *c);	/* Error or NULL */
+line_t ubasic_line(struct ubasic_ctx *c);
+void ubasic_set_user(struct ubasic_ctx *c, void *user);
+void *ubasic_user(struct ubasic_ctx *c);
+struct ubasic_ctx *ubasic_current(void);
 void ubasic_tokenizer_error(void);
-int ubasic_finished(void);
+unsigned int ubasic_string_highwater(struct ubasic_ctx *c);
+
+/* FOR and GOSUB stacks grow as needed up to a limit, after which the
+   program fails. The high water marks are the deepest each has been */
+#ifndef UBASIC_FOR_DEPTH
+#define UBASIC_FOR_DEPTH	64
+#endif
+#ifndef UBASIC_GOSUB_DEPTH
+#define UBASIC_GOSUB_DEPTH	256
+#endif
+
+void ubasic_set_stack_limits(struct ubasic_ctx *c, unsigned int fors,
+                             unsigned int gosubs);
+void ubasic_stack_highwater(struct ubasic_ctx *c, unsigned int *fors,
+                            unsigned int *gosubs);
+
+/* String variable heap. used - live is lost to rounding up to a block
+   size, free is sitting on the free lists */
+struct ubasic_string_stats {
+  unsigned long heap;		/* Bytes obtained from malloc */
+  unsigned long used;		/* Bytes in blocks holding strings */
+  unsigned long live;		/* Bytes of string actually stored */
+  unsigned long free;		/* Bytes in blocks on the free lists */
+  unsigned long allocs;		/* Blocks handed out */
+};
+
+void ubasic_string_stats(struct ubasic_ctx *c, struct ubasic_string_stats *s);
+
+/* Per line profile, from UBASIC_PROFILE. runs counts the times the line
+   was started from the top */
+struct ubasic_line_profile {
+  line_t line;
+  unsigned long runs;
+  unsigned long statements;	/* Statements run on the line */
+  unsigned long us;		/* Microseconds spent in them */
+};
+
+/* Counters from UBASIC_STATS */
+struct ubasic_stats {
+  unsigned long statements[256];	/* By token, see ubasic_statement_name() */
+  unsigned long tokens;			/* Tokens read */
+  unsigned long compiled;		/* Expressions and LETs run as code */
+  unsigned long interpreted;		/* and walked by the parser */
+  unsigned long line_lookups;		/* Line number searches */
+  unsigned long linerefs;		/* Jumps resolved when crunched */
+  unsigned long temp_bytes;		/* String workspace handed out */
+  unsigned long temp_chunks;		/* Workspace chunks malloc'd */
+  unsigned long string_allocs;		/* String variable blocks */
+  unsigned long string_slabs;		/* String heap slabs malloc'd */
+};
+
+int ubasic_stats(struct ubasic_ctx *c, struct ubasic_stats *s);
+const char *ubasic_statement_name(int token);
+
+/* The lines that ran, most time first. The array belongs to the context
+   and lasts until the next call */
+unsigned int ubasic_profile(struct ubasic_ctx *c,
+                            struct ubasic_line_profile **lines);
+
+/* Program output. The sink is handed whole blocks of text, by default it
+   writes them to fd 1. size may be anything up to UBASIC_OUTBUF */
+#ifndef UBASIC_OUTBUF
+#define UBASIC_OUTBUF	512
+#endif
+#define UBASIC_LINEBUF	1	/* Also flush at the end of each line */
+
+typedef void (*ubasic_sink_t)(struct ubasic_ctx *c, const char *p,
+                              unsigned int len);
+
+void ubasic_set_output(struct ubasic_ctx *c, ubasic_sink_t sink,
+                       unsigned int size, int flags);
+void ubasic_flush(struct ubasic_ctx *c);
+
+/* Where INPUT reads from, by default fd 0. Each call should return a line
+   of at most len bytes, or 0 at the end */
+typedef int (*ubasic_source_t)(struct ubasic_ctx *c, char *p,
+                               unsigned int len);
 
-extern line_t line_num;
+void ubasic_set_input(struct ubasic_ctx *c, ubasic_source_t source);
 
-void ubasic_get_variable(int varnum, struct typevalue *v, int nsubs, struct typevalue *subs);
-void ubasic_set_variable(int varum, struct typevalue *value, int nsubs, struct typevalue *subs);
+void ubasic_get_variable(struct ubasic_ctx *c, int varnum,
+                         struct typevalue *v,
+                         int nsubs, struct typevalue *subs);
+void ubasic_set_variable(struct ubasic_ctx *c, int varum,
+                         struct typevalue *value,
+                         int nsubs, struct typevalue *subs);
 
 /* Provided by user */
 void clear_display(void);
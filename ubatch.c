@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ *	Batch runner: run a list of programs, or one program against a list of
+ *	input files, on a pool of threads. Each run's output is collected and
+ *	written out whole, in the order given, so nothing interleaves. Runs
+ *	that fail are reported on stderr and the exit status is 1 if any did.
+ *
+ *	ubatch [-j threads] [program ...]
+ *	ubatch [-j threads] -i program [input ...]
+ *
+ *	With no files named they are read one per line from stdin.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ubasic.h"
+
+struct job {
+  const char *name;		/* Program, or input set with -i */
+  char *out;			/* Collected output */
+  unsigned int outlen, outsize;
+  char *input;			/* Input set being read by INPUT */
+  char *inptr;
+  const char *error;
+  line_t line;
+  uint8_t done;
+};
+
+static struct job *jobs;
+static unsigned int njobs;
+static unsigned int next_job, next_emit;
+static unsigned int failed;
+static char *shared_program;	/* The one program with -i */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char nomem[] = "Out of memory";
+
+/*---------------------------------------------------------------------------*/
+value_t peek_function(value_t arg)
+{
+  return arg;
+}
+
+void poke_function(value_t arg, value_t value)
+{
+}
+
+void clear_display(void)
+{
+}
+
+int move_cursor(int x, int y)
+{
+  return 0;
+}
+
+void begin_input(void)
+{
+}
+
+void end_input(void)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+static char *load(const char *name)
+{
+  struct stat s;
+  char *buf;
+  int fd = open(name, O_RDONLY);
+
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &s) == -1 || (buf = malloc(s.st_size + 1)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if (read(fd, buf, s.st_size) != s.st_size) {
+    free(buf);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  buf[s.st_size] = 0;
+  return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+static void job_sink(struct ubasic_ctx *c, const char *p, unsigned int len)
+{
+  struct job *j = ubasic_user(c);
+  char *n;
+
+  if (j->outlen + len > j->outsize) {
+    n = realloc(j->out, 2 * j->outsize + len);
+    if (n == NULL) {
+      j->error = nomem;
+      return;
+    }
+    j->out = n;
+    j->outsize = 2 * j->outsize + len;
+  }
+  memcpy(j->out + j->outlen, p, len);
+  j->outlen += len;
+}
+
+/* Hand INPUT the input set a line at a time */
+static int job_source(struct ubasic_ctx *c, char *p, unsigned int len)
+{
+  struct job *j = ubasic_user(c);
+  unsigned int n = 0;
+
+  if (j->inptr == NULL)
+    return 0;
+  while(n < len && j->inptr[n]) {
+    if (j->inptr[n++] == '\n')
+      break;
+  }
+  memcpy(p, j->inptr, n);
+  j->inptr += n;
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static void run_job(struct job *j)
+{
+  struct ubasic_ctx *c;
+  char *program = shared_program;
+  const char *err;
+
+  if (program == NULL)
+    program = load(j->name);
+  else
+    j->inptr = j->input = load(j->name);
+  if (program == NULL || (shared_program && j->input == NULL)) {
+    j->error = "Cannot read";
+    return;
+  }
+
+  c = ubasic_init_flags(program,
+                        UBASIC_CRUNCH | UBASIC_COMPILE | UBASIC_QUIET);
+  if (c == NULL)
+    j->error = nomem;
+  else {
+    ubasic_set_user(c, j);
+    ubasic_set_output(c, job_sink, 0, 0);
+    ubasic_set_input(c, job_source);
+    while(!ubasic_finished(c))
+      ubasic_run(c);
+    ubasic_flush(c);
+    if ((err = ubasic_failed(c)) != NULL) {
+      j->error = err;
+      j->line = ubasic_line(c);
+    }
+    ubasic_free(c);
+  }
+  if (program != shared_program)
+    free(program);
+  free(j->input);
+  j->input = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Write out every finished run we can without getting out of order.
+   Called with the lock held */
+static void emit(void)
+{
+  struct job *j;
+
+  while(next_emit < njobs && jobs[next_emit].done) {
+    j = &jobs[next_emit++];
+    fwrite(j->out, 1, j->outlen, stdout);
+    if (j->error) {
+      fflush(stdout);
+      if (j->line)
+        fprintf(stderr, "%s: %u: %s error.\n", j->name, j->line, j->error);
+      else
+        fprintf(stderr, "%s: %s error.\n", j->name, j->error);
+      failed++;
+    }
+    free(j->out);
+    j->out = NULL;
+  }
+}
+
+static void *worker(void *unused)
+{
+  struct job *j;
+
+  for(;;) {
+    pthread_mutex_lock(&lock);
+    if (next_job == njobs) {
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+    j = &jobs[next_job++];
+    pthread_mutex_unlock(&lock);
+
+    run_job(j);
+
+    pthread_mutex_lock(&lock);
+    j->done = 1;
+    emit();
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void add_job(const char *name)
+{
+  static unsigned int size;
+  struct job *n;
+
+  if (njobs == size) {
+    size = size ? 2 * size : 256;
+    n = realloc(jobs, size * sizeof(struct job));
+    if (n == NULL) {
+      fprintf(stderr, "ubatch: out of memory.\n");
+      exit(2);
+    }
+    jobs = n;
+  }
+  memset(jobs + njobs, 0, sizeof(struct job));
+  jobs[njobs++].name = name;
+}
+
+static void read_jobs(void)
+{
+  char buf[4096];
+  char *p;
+
+  while(fgets(buf, sizeof(buf), stdin)) {
+    buf[strcspn(buf, "\r\n")] = 0;
+    if (*buf == 0)
+      continue;
+    if ((p = strdup(buf)) == NULL) {
+      fprintf(stderr, "ubatch: out of memory.\n");
+      exit(2);
+    }
+    add_job(p);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+  pthread_t *threads;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *program = NULL;
+  int opt, i;
+
+  while((opt = getopt(argc, argv, "i:j:")) != -1) {
+    switch(opt) {
+    case 'i':
+      program = optarg;
+      break;
+    case 'j':
+      nthreads = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "%s: [-j threads] [-i program] [file ...]\n", argv[0]);
+      exit(2);
+    }
+  }
+  if (program) {
+    shared_program = load(program);
+    if (shared_program == NULL) {
+      perror(program);
+      exit(2);
+    }
+  }
+  for (i = optind; i < argc; i++)
+    add_job(argv[i]);
+  if (optind == argc)
+    read_jobs();
+
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > njobs)
+    nthreads = njobs;
+  threads = malloc(nthreads * sizeof(pthread_t));
+  if (threads == NULL && nthreads) {
+    fprintf(stderr, "ubatch: out of memory.\n");
+    exit(2);
+  }
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL)) {
+      /* Make do with what we have */
+      if (i == 0) {
+        perror("pthread_create");
+        exit(2);
+      }
+      nthreads = i;
+      break;
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  fflush(stdout);
+  if (failed)
+    fprintf(stderr, "%u of %u runs failed.\n", failed, njobs);
+  return failed ? 1 : 0;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ *	Benchmark suite. Each program is run a couple of times to warm up
+ *	and then timed over a number of runs. The report gives the median
+ *	and 95th percentile times and statements per second, one tab
+ *	separated line per benchmark so that it can be saved and handed back
+ *	with -b to compare against.
+ *
+ *	ubench [-n runs] [-b baseline] [name ...]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ubasic.h"
+
+#define WARMUP	2
+#define RUNS	11
+#define MAX_RUNS	101
+
+struct bench {
+  const char *name;
+  const char *program;
+};
+
+/* Rugg/Feldman (Kilobaud, 1977) with the loops stretched and in integers */
+static const char bm1[] =
+"10 for k = 1 to 20000\n\
+20 next k\n\
+30 stop\n";
+
+static const char bm2[] =
+"10 let k = 0\n\
+20 let k = k + 1\n\
+30 if k < 20000 then 20\n\
+40 stop\n";
+
+static const char bm3[] =
+"10 let k = 0\n\
+20 let k = k + 1\n\
+30 let a = k / k * k + k - k\n\
+40 if k < 20000 then 20\n\
+50 stop\n";
+
+static const char bm4[] =
+"10 let k = 0\n\
+20 let k = k + 1\n\
+30 let a = k / 2 * 3 + 4 - 5\n\
+40 if k < 20000 then 20\n\
+50 stop\n";
+
+static const char bm5[] =
+"10 let k = 0\n\
+20 let k = k + 1\n\
+30 let a = k / 2 * 3 + 4 - 5\n\
+40 gosub 100\n\
+50 if k < 20000 then 20\n\
+60 stop\n\
+100 return\n";
+
+static const char bm6[] =
+"10 let k = 0\n\
+15 dim m(5)\n\
+20 let k = k + 1\n\
+30 let a = k / 2 * 3 + 4 - 5\n\
+40 gosub 100\n\
+45 for l = 1 to 5\n\
+47 next l\n\
+50 if k < 20000 then 20\n\
+60 stop\n\
+100 return\n";
+
+static const char bm7[] =
+"10 let k = 0\n\
+15 dim m(5)\n\
+20 let k = k + 1\n\
+30 let a = k / 2 * 3 + 4 - 5\n\
+40 gosub 100\n\
+45 for l = 1 to 5\n\
+46 let m(l) = a\n\
+47 next l\n\
+50 if k < 20000 then 20\n\
+60 stop\n\
+100 return\n";
+
+static const char sieve[] =
+"10 dim f(8191)\n\
+20 let c = 0\n\
+30 for i = 2 to 8190\n\
+40 if f(i) then 90\n\
+50 let c = c + 1\n\
+55 if i + i > 8190 then 90\n\
+60 for k = i + i to 8190 step i\n\
+70 let f(k) = 1\n\
+80 next k\n\
+90 next i\n\
+100 stop\n";
+
+static const char strings[] =
+"10 for j = 1 to 200\n\
+20 let a$ = chr$(64)\n\
+30 for i = 1 to 50\n\
+40 let a$ = a$ + chr$(65 + i mod 26)\n\
+50 next i\n\
+60 let b$ = left$(a$, 10) + mid$(a$, 5, 10) + right$(a$, 5)\n\
+70 next j\n\
+80 stop\n";
+
+static const char gosub[] =
+"10 for i = 1 to 10000\n\
+20 gosub 100\n\
+30 next i\n\
+40 stop\n\
+100 gosub 200 : return\n\
+200 let a = a + 1 : return\n";
+
+static const char arrays[] =
+"10 dim m(20, 20)\n\
+20 for r = 1 to 20\n\
+30 for i = 0 to 19\n\
+40 for j = 0 to 19\n\
+50 let m(i, j) = m(j, i) + i * j mod 7\n\
+60 next j\n\
+70 next i\n\
+80 next r\n\
+90 stop\n";
+
+static const char print[] =
+"10 for i = 1 to 2000\n\
+20 print i; \" \"; i * 3; \",\", chr$(65 + i mod 26)\n\
+30 next i\n\
+40 stop\n";
+
+static const struct bench benches[] = {
+  { "bm1", bm1 },
+  { "bm2", bm2 },
+  { "bm3", bm3 },
+  { "bm4", bm4 },
+  { "bm5", bm5 },
+  { "bm6", bm6 },
+  { "bm7", bm7 },
+  { "sieve", sieve },
+  { "strings", strings },
+  { "gosub", gosub },
+  { "arrays", arrays },
+  { "print", print },
+  { NULL, NULL }
+};
+
+/*---------------------------------------------------------------------------*/
+value_t peek_function(value_t arg)
+{
+  return arg;
+}
+
+void poke_function(value_t arg, value_t value)
+{
+}
+
+void clear_display(void)
+{
+}
+
+int move_cursor(int x, int y)
+{
+  return 0;
+}
+
+void begin_input(void)
+{
+}
+
+void end_input(void)
+{
+}
+
+/* Measure the interpreter, not the terminal */
+static void null_sink(struct ubasic_ctx *c, const char *p, unsigned int len)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Load and run the program once, returning the time taken and setting
+   the number of statements run. Loading is part of the cost */
+static double run(const struct bench *b, unsigned long *statements)
+{
+  struct ubasic_ctx *c;
+  unsigned long n = 0;
+  double start = now(), t;
+
+  c = ubasic_init(b->program);
+  if (c == NULL) {
+    fprintf(stderr, "ubench: out of memory.\n");
+    exit(1);
+  }
+  ubasic_set_output(c, null_sink, 0, 0);
+  while(!ubasic_finished(c))
+    n += ubasic_run_steps(c, 100000);
+  t = now() - start;
+  if (ubasic_failed(c)) {
+    fprintf(stderr, "ubench: %s failed.\n", b->name);
+    exit(1);
+  }
+  ubasic_free(c);
+  *statements = n;
+  return t;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Baseline medians from an earlier report */
+static struct baseline {
+  char name[32];
+  double median;
+} baseline[64];
+static unsigned int nbaseline;
+
+static void load_baseline(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char line[256];
+
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  while(fgets(line, sizeof(line), f) && nbaseline < 64) {
+    if (*line == '#')
+      continue;
+    if (sscanf(line, "%31s %lf", baseline[nbaseline].name,
+               &baseline[nbaseline].median) == 2)
+      nbaseline++;
+  }
+  fclose(f);
+}
+
+static double find_baseline(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < nbaseline; i++)
+    if (strcmp(baseline[i].name, name) == 0)
+      return baseline[i].median;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int wanted(const char *name, char **names, int n)
+{
+  int i;
+
+  if (n == 0)
+    return 1;
+  for (i = 0; i < n; i++)
+    if (strcmp(names[i], name) == 0)
+      return 1;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const struct bench *b;
+  double times[MAX_RUNS];
+  double median, p95, base;
+  unsigned long statements;
+  int runs = RUNS;
+  int opt, i;
+
+  while((opt = getopt(argc, argv, "n:b:")) != -1) {
+    switch(opt) {
+    case 'n':
+      runs = atoi(optarg);
+      if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "ubench: runs must be 1 to %d.\n", MAX_RUNS);
+        exit(1);
+      }
+      break;
+    case 'b':
+      load_baseline(optarg);
+      break;
+    default:
+      fprintf(stderr, "%s: [-n runs] [-b baseline] [name ...]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  printf("# name\tmedian_us\tp95_us\tstatements\tstatements_per_s%s\n",
+         nbaseline ? "\tchange" : "");
+  for (b = benches; b->name; b++) {
+    if (!wanted(b->name, argv + optind, argc - optind))
+      continue;
+    for (i = 0; i < WARMUP; i++)
+      run(b, &statements);
+    for (i = 0; i < runs; i++)
+      times[i] = run(b, &statements);
+    qsort(times, runs, sizeof(double), compare);
+    median = times[runs / 2];
+    /* Nearest rank */
+    p95 = times[(95 * runs + 99) / 100 - 1];
+    printf("%s\t%.0f\t%.0f\t%lu\t%.0f", b->name, median * 1e6, p95 * 1e6,
+           statements, statements / median);
+    base = find_baseline(b->name);
+    if (base)
+      printf("\t%+.1f%%", 100.0 * (median * 1e6 - base) / base);
+    printf("\n");
+    fflush(stdout);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
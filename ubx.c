@@ -47,6 +47,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+/* Hosts that say they have mmap() get the program mapped rather than
+   read in. Fuzix, ELKS and DOS don't, and read it as they always have */
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0 && !defined(__ia16__)
+#define UBX_MMAP
+#include <sys/mman.h>
+#endif
+/* Likewise -S needs a POSIX.1-2001 host for UNIX sockets */
+#if defined(_POSIX_VERSION) && _POSIX_VERSION >= 200112L && !defined(__ia16__)
+#define UBX_SERVE
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include "ubasic.h"
 
 /*---------------------------------------------------------------------------*/
@@ -59,13 +73,150 @@ void poke_function(value_t arg, value_t value) {
     assert(arg == value);
 }
 
+static void newline(void);
+
+/*---------------------------------------------------------------------------*/
+/* Reports are built a line at a time and written to stderr, so there is
+   no stdio or floating point to drag in. A negative width pads on the
+   right */
+static char report[80];
+static unsigned int report_len;
+
+static void report_str(const char *s, int width)
+{
+  unsigned int len = strlen(s);
+  unsigned int w = width < 0 ? -width : width;
+  unsigned int pad = len < w ? w - len : 0;
+
+  if (report_len + len + pad > sizeof(report))
+    return;
+  if (width > 0)
+    for (; pad; pad--)
+      report[report_len++] = ' ';
+  memcpy(report + report_len, s, len);
+  report_len += len;
+  for (; pad; pad--)
+    report[report_len++] = ' ';
+}
+
+static void report_num(unsigned long v, int width)
+{
+  char buf[12];
+  char *p = buf + sizeof(buf);
+
+  *--p = 0;
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while(v);
+  report_str(p, width);
+}
+
+static void report_end(void)
+{
+  write(2, report, report_len);
+  report_len = 0;
+  newline();
+}
+
+/*---------------------------------------------------------------------------*/
+/* Where the time went, busiest lines first */
+static void profile_report(struct ubasic_ctx *c)
+{
+  struct ubasic_line_profile *p;
+  unsigned int i, n = ubasic_profile(c, &p);
+  unsigned long total = 0, tenths;
+
+  for (i = 0; i < n; i++)
+    total += p[i].us;
+  report_str("Line", 6);
+  report_str("Runs", 11);
+  report_str("Statements", 11);
+  report_str("Time (us)", 13);
+  report_str("%", 7);
+  report_end();
+  for (i = 0; i < n; i++) {
+    /* Tenths of a percent, without overflowing a 32bit long */
+    if (total >= 1000)
+      tenths = p[i].us / (total / 1000);
+    else
+      tenths = total ? p[i].us * 1000 / total : 0;
+    report_num(p[i].line, 6);
+    report_num(p[i].runs, 11);
+    report_num(p[i].statements, 11);
+    report_num(p[i].us, 13);
+    report_num(tenths / 10, 4);
+    report_str(".", 0);
+    report_num(tenths % 10, 0);
+    report_str("%", 0);
+    report_end();
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void stat_line(const char *name, unsigned long v)
+{
+  report_str(name, -16);
+  report_num(v, 11);
+  report_end();
+}
+
+static void stats_report(struct ubasic_ctx *c)
+{
+  struct ubasic_stats s;
+  const char *name;
+  int i;
+
+  if (!ubasic_stats(c, &s))
+    return;
+  for (i = 0; i < 256; i++) {
+    if (s.statements[i] == 0)
+      continue;
+    name = ubasic_statement_name(i);
+    stat_line(name ? name : "?", s.statements[i]);
+  }
+  stat_line("tokens", s.tokens);
+  stat_line("compiled", s.compiled);
+  stat_line("interpreted", s.interpreted);
+  stat_line("line lookups", s.line_lookups);
+  stat_line("linerefs", s.linerefs);
+  stat_line("temp bytes", s.temp_bytes);
+  stat_line("temp chunks", s.temp_chunks);
+  stat_line("string allocs", s.string_allocs);
+  stat_line("string slabs", s.string_slabs);
+}
+
 /*---------------------------------------------------------------------------*/
-void run(const char program[]) {
-  ubasic_init(program);
+static struct ubasic_ctx *prepare(const char program[], unsigned long len,
+                                  int flags)
+{
+  struct ubasic_ctx *c;
+
+  if (len >= 4 && memcmp(program, UBASIC_IMAGE_MAGIC, 4) == 0)
+    c = ubasic_init_image(program, len, UBASIC_COMPILE | flags);
+  else
+    c = ubasic_init_flags(program, UBASIC_CRUNCH | UBASIC_COMPILE | flags);
+  if (c == NULL) {
+    write(2, "Out of memory.", 14);
+    newline();
+    exit(1);
+  }
+  return c;
+}
 
+/*---------------------------------------------------------------------------*/
+static void run(struct ubasic_ctx *c, int flags)
+{
   do {
-    ubasic_run();
-  } while(!ubasic_finished());
+    ubasic_run(c);
+  } while(!ubasic_finished(c));
+  if (flags & UBASIC_PROFILE)
+    profile_report(c);
+  if (flags & UBASIC_STATS)
+    stats_report(c);
+  if (ubasic_failed(c))
+    exit(1);
+  ubasic_free(c);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -214,8 +365,6 @@ void end_input(void)
 
 #endif
 
-static char *buf;
-
 /* FIXME: maybe make error message output go through charout(...), and in
    this way factor out the handling of '\n'.  One wrinkle is that
    charout(...) normally outputs to stdout, not stderr.  -- tkchia */
@@ -230,23 +379,171 @@ static void newline(void)
   write(2, OS_NEWLINE, strlen(OS_NEWLINE));
 }
 
-int main(int argc, char *argv[])
+#ifdef UBX_MMAP
+/* Map the program read-only. The tokenizer wants a NUL at the end, so
+   reserve one zeroed byte past the file with an anonymous mapping and lay
+   the file over its front: the tail of the last file page and the page
+   after it both read as zero, and nothing is copied. */
+static const char *load(int fd, off_t size)
 {
-  int fd, l;
-  struct stat s;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = ((size_t)size + page) & ~(page - 1);
+  char *p;
+
+  p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  if (size && mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED)
+    return NULL;
+  return p;
+}
+#else
+static const char *load(int fd, off_t size)
+{
+  char *buf;
 
-  if (argc != 2) {
-    write(2, argv[0], strlen(argv[0]));
-    write(2, ": program", 9);
+  /* Align to the next quad */
+  buf = sbrk((size|3) + 1);
+  if (buf == (char *)-1)
+    return NULL;
+  if (read(fd, buf, size) != size)
+    return NULL;
+  buf[size] = 0;
+  return buf;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+#ifdef UBX_SERVE
+/*---------------------------------------------------------------------------*/
+/* Load once and fork a child to run each connection to the socket, with
+   the connection as its stdin, stdout and stderr. The children start
+   from the loaded program so each request costs a fork and the run */
+static void serve(struct ubasic_ctx *c, int flags, const char *path)
+{
+  struct sockaddr_un sun;
+  int s, fd;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sun.sun_path)) {
+    write(2, "Socket name too long.", 21);
     newline();
     exit(1);
   }
+  strcpy(sun.sun_path, path);
+  unlink(path);
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == -1 || bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+      listen(s, 64) == -1) {
+    perror(path);
+    exit(1);
+  }
+  /* Nobody waits for the children */
+  signal(SIGCHLD, SIG_IGN);
+  /* Whoever is on the other end, it isn't a terminal */
+  ubasic_set_output(c, NULL, 0, 0);
+  for (;;) {
+    fd = accept(s, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror(path);
+      exit(1);
+    }
+    switch(fork()) {
+    case 0:
+      close(s);
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+      if (fd > 2)
+        close(fd);
+      run(c, flags);
+      exit(0);
+    case -1:
+      perror("fork");
+      break;
+    }
+    close(fd);
+  }
+}
+#endif
 
-  visual_init();
+/*---------------------------------------------------------------------------*/
+/* Load the program and save it as an image ubx can run without loading */
+static void compile(const char program[], const char *name)
+{
+  struct ubasic_ctx *c;
+  void *image;
+  unsigned long len;
+  int fd;
+
+  c = ubasic_init_flags(program, UBASIC_CRUNCH);
+  /* A program that failed to load has already said why */
+  if (c != NULL && ubasic_failed(c))
+    exit(1);
+  if (c == NULL || (image = ubasic_image(c, &len)) == NULL) {
+    write(2, "Out of memory.", 14);
+    newline();
+    exit(1);
+  }
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1 || write(fd, image, len) != (ssize_t)len || close(fd) == -1) {
+    perror(name);
+    exit(1);
+  }
+  free(image);
+  ubasic_free(c);
+}
+
+/*---------------------------------------------------------------------------*/
+static void usage(const char *name)
+{
+  write(2, name, strlen(name));
+#ifdef UBX_SERVE
+  write(2, ": [-p] [-s] [-S socket] program | -c program -o image", 53);
+#else
+  write(2, ": [-p] [-s] program | -c program -o image", 41);
+#endif
+  newline();
+  exit(1);
+}
 
-  fd = open(argv[1], O_RDONLY);
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+  int fd, i;
+  int flags = 0, crunch = 0;
+  struct stat s;
+  const char *program;
+  const char *name = NULL, *output = NULL, *server = NULL;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0)
+      flags |= UBASIC_PROFILE;
+    else if (strcmp(argv[i], "-s") == 0)
+      flags |= UBASIC_STATS;
+    else if (strcmp(argv[i], "-c") == 0)
+      crunch = 1;
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+#ifdef UBX_SERVE
+    else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+      server = argv[++i];
+#endif
+    else if (argv[i][0] != '-' && name == NULL)
+      name = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (name == NULL || crunch != (output != NULL) || (crunch && server))
+    usage(argv[0]);
+
+  fd = open(name, O_RDONLY);
   if (fd == -1 || fstat(fd, &s) == -1) {
-    perror(argv[1]);
+    perror(name);
     exit(1);
   }
   if ((s.st_size|3) >= ~(size_t)0) {
@@ -254,20 +551,21 @@ int main(int argc, char *argv[])
     newline();
     exit(1);
   }
-  /* Align to the next quad */
-  buf = sbrk((s.st_size|3) + 1);
-  if (buf == (char *)-1) {
-    write(2, "Out of memory.", 14);
-    newline();
-    exit(1);
-  }
-  l = read(fd, buf, s.st_size);
-  if (l != s.st_size) {
-    perror(argv[1]);
+  program = load(fd, s.st_size);
+  if (program == NULL) {
+    perror(name);
     exit(1);
   }
   close(fd);
-  buf[l] = 0;
-  run(buf);
+  if (output) {
+    compile(program, output);
+    return 0;
+  }
+  visual_init();
+#ifdef UBX_SERVE
+  if (server)
+    serve(prepare(program, s.st_size, flags), flags, server);
+#endif
+  run(prepare(program, s.st_size, flags), flags);
   return 0;
 }
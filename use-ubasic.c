@@ -74,11 +74,14 @@ void poke_function(value_t arg, value_t value)
 int
 main(void)
 {
-  ubasic_init(program);
+  struct ubasic_ctx *c = ubasic_init(program);
 
+  if (c == NULL)
+    return 1;
   do {
-    ubasic_run();
-  } while(!ubasic_finished());
+    ubasic_run(c);
+  } while(!ubasic_finished(c));
+  ubasic_free(c);
 
   return 0;
 }